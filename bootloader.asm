@@ -2,24 +2,106 @@
 org 0x7c00 ; where to put the next piece of code related to the current segment
 use16
 
+CHUNK_SECTORS equ 64                  ; sectors per disk read
+CHUNK_BYTES   equ CHUNK_SECTORS * 512
+BOUNCE        equ 0x8000              ; 32 KiB below 64 KiB, so no read crosses a 64 KiB dma boundary
+KERNEL_MAGIC  equ 0x4c4e524b          ; "KRNL", first word of the kernel image header
+BOOT_INFO     equ 0x900               ; disk reads, sectors read, tsc before and after loading, the kernel prints them
+BOOT_INFO_SIZE equ 48                 ; followed by the tsc around decompressing and at the kernel entry
+
 ; initialize segment selectors
 xor ax, ax
 mov ds, ax
 mov es, ax
 mov ss, ax
+mov sp, 0x7c00
+mov [drive], dl ; the bios passes the boot drive
+cld
+xor eax, eax ; the kernel finds zeros for what a boot step did not measure
+mov di, BOOT_INFO
+mov cx, BOOT_INFO_SIZE / 4
+rep stosd
+
+; enable the a20 line (fast a20 gate), so memory above 1 MiB does not wrap around
+in al, 0x92
+or al, 0x2
+and al, 0xfe ; bit 0 would reset the machine
+out 0x92, al
 
-; load sector two
-mov ax, 0x0
-mov es, ax     ; es:bx pointer to buffer
-mov bx, 0x8000 ; es:bx pointer to buffer
-mov ah, 0x02 ; function
-mov al, 16 ; number of sectors to read
-mov ch, 0 ; track
-mov cl, 2 ; sector
-mov dh, 0 ; head
-mov dl, 0 ; drive
+; the int 13h extensions read by lba and many sectors per call
+mov ah, 0x41
+mov bx, 0x55aa
+mov dl, [drive]
 int 0x13
-jc error ; c flag is set, if error during disk load occured
+jc error
+cmp bx, 0xaa55
+jne error
+
+rdtsc
+mov [BOOT_INFO + 8], eax
+mov [BOOT_INFO + 12], edx
+
+; the kernel image starts with a header: magic, load address, size in bytes and entry point.
+; it is read in chunks into the bounce buffer and copied to the load address above 1 MiB in unreal mode
+load:
+  mov si, dap
+  mov ah, 0x42 ; extended read
+  mov dl, [drive]
+  int 0x13
+  jc error
+  inc dword [BOOT_INFO]
+  add dword [BOOT_INFO + 4], CHUNK_SECTORS
+
+  cmp dword [entry], 0 ; the first chunk holds the header
+  jne .copy
+  cmp dword [BOUNCE], KERNEL_MAGIC
+  jne error
+  mov eax, [BOUNCE + 4]
+  mov [dest], eax
+  mov eax, [BOUNCE + 8]
+  mov [remaining], eax
+  mov eax, [BOUNCE + 12]
+  mov [entry], eax
+
+.copy:
+  call unreal ; the bios may have reloaded the segment registers
+  mov esi, BOUNCE
+  mov edi, [dest]
+  mov ecx, CHUNK_BYTES / 4
+  a32 rep movsd ; whole chunks, the kernel clears the bss behind the image
+  add dword [dest], CHUNK_BYTES
+  add dword [dap.lba], CHUNK_SECTORS
+  sub dword [remaining], CHUNK_BYTES
+  ja load
+
+rdtsc
+mov [BOOT_INFO + 16], eax
+mov [BOOT_INFO + 20], edx
+
+; query the bios memory map, the kernel reads the entry count from 0x500 and the entries from 0x504
+xor ax, ax
+mov es, ax
+mov di, 0x504 ; es:di pointer to the next entry
+xor ebx, ebx  ; continuation value, zero for the first entry
+xor bp, bp    ; number of entries
+memory_map:
+  mov eax, 0xe820
+  mov edx, 0x534d4150 ; 'SMAP'
+  mov ecx, 24
+  mov dword [es:di + 20], 1 ; acpi extended attributes, valid unless the bios says otherwise
+  int 0x15
+  jc .done
+  cmp eax, 0x534d4150
+  jne .done
+  add di, 24
+  inc bp
+  cmp bp, 32 ; maximum number of entries
+  je .done
+  test ebx, ebx ; zero after the last entry
+  jnz memory_map
+.done:
+  mov [0x500], bp
+  mov word [0x502], 0
 
 ; turn off maskable interrupts
 cli
@@ -36,6 +118,24 @@ mov cr0, eax
 ; far jump, sets code segments selector cs to 0x8 (first non-null descriptors)
 jmp 0x8:protected_mode
 
+; loads ds and es with 4 GiB limits in protected mode and returns to real mode, the limits stay cached
+unreal:
+  cli
+  lgdt [gdtr]
+  mov eax, cr0
+  or al, 0x1
+  mov cr0, eax
+  mov bx, gdt.data
+  mov ds, bx
+  mov es, bx
+  and al, 0xfe
+  mov cr0, eax
+  xor bx, bx
+  mov ds, bx
+  mov es, bx
+  sti
+  ret
+
 ; error message
 error:
   mov si, .msg
@@ -48,7 +148,7 @@ error:
   jmp .loop
 .done:
   jmp $
-  .msg db "could not read disk", 0
+  .msg db "could not load kernel", 0
 
 protected_mode:
   ; switch to 32 bit instructions
@@ -62,9 +162,24 @@ protected_mode:
   mov ss, ax
   mov esp, 0x7c00 ; stack from 0x0000 to 0x7c00
   ; call loaded code
-  call 0x8000
+  call [entry]
   jmp $
 
+; disk address packet of the extended read
+dap:
+  db 0x10 ; size of the packet
+  db 0
+  dw CHUNK_SECTORS
+  dw BOUNCE ; offset
+  dw 0      ; segment
+.lba:
+  dq 1 ; the kernel starts with the second sector
+
+drive:     db 0
+dest:      dd 0 ; where the next chunk is copied to
+remaining: dd 0 ; bytes of the image not yet copied
+entry:     dd 0
+
 ; global descriptor table
 gdt:
   dq 0
@@ -1,4 +1,4 @@
-void start(); // has to be first symbol
+void start(); // entry point, the bootloader finds it in the image header
 
 typedef int i32;
 typedef short int i16;
@@ -8,22 +8,57 @@ typedef unsigned int u32;
 typedef unsigned short int u16;
 typedef unsigned char u8;
 
+typedef long long i64;
+typedef unsigned long long u64;
+
+// code and data user mode may access, every other kernel page is supervisor only
+#define USER      __attribute__((section(".user.text")))
+#define USER_DATA __attribute__((section(".user.data")))
+
 void clear_screen();
 void put_char(char);
+void console_write(char const*, u32);
+void halt();
+void console_scroll(i32);
 
 void print(char const*);
 void print_u32();
 void print_u32_hex();
+void put_u32(u32);
 
+void clear_bss();
+void init_boot_cpu();
 void init_gdt();
+void init_frames();
+void init_slab();
 void init_paging();
+u32 init_acpi();
+void init_apic(u32 acpi_found);
+u32 init_serial();
+void init_keyboard();
 void init_interrupt_handlers();
 void init_tasks();
+void init_timer();
+void boot_info_start();
+void print_boot_io();
+void init_smp();
+void init_fpu();
+void init_syscalls();
+void init_trace();
+void init_profile();
 
 void switch_to_user_mode();
 
+void run_benchmarks();
+
+extern u32 apic_enabled;
+extern u32 num_cpus;
+
 void start() 
 {
+  boot_info_start();
+  clear_bss();
+  init_boot_cpu();
   clear_screen();
 
   print("Init gdt...\n");
@@ -34,18 +69,75 @@ void start()
   init_interrupt_handlers();
   print("Interrupts initialized!\n");
 
+  print("Init frame allocator...\n");
+  init_frames();
+  init_slab();
+  print("Frame allocator initialized!\n");
+
+  u32 acpi_found = init_acpi();
+
   print("Init paging...\n");
   init_paging();
   print("Paging initialized!\n");
 
+  print("Init apic...\n");
+  init_apic(acpi_found);
+  print(apic_enabled ? "Apic initialized!\n" : "No apic, using the pic!\n");
+
+  print("Init serial...\n");
+  print(init_serial() ? "Serial initialized!\n" : "No serial port!\n");
+
+  print("Init keyboard...\n");
+  init_keyboard();
+  print("Keyboard initialized!\n");
+
+  print("Init timer...\n");
+  init_timer();
+  print("Timer initialized!\n");
+
+  print_boot_io();
+
+  print("Init fpu...\n");
+  init_fpu();
+  print("Fpu initialized!\n");
+
+  print("Init syscalls...\n");
+  init_syscalls();
+  print("Syscalls initialized!\n");
+
+  print("Init smp...\n");
+  init_smp();
+  put_u32(num_cpus);
+  print(" cpus online!\n");
+
+  init_trace();
+  init_profile();
+
   init_tasks();
 
+#ifdef BENCH
+  run_benchmarks();
+#endif
+
   print("Switching to user mode...\n");
-  asm volatile("jmp switch_to_user_mode");
+  switch_to_user_mode();
 }
 
+extern u32 _text_start;
+extern u32 _user_start;
+extern u32 _user_end;
+extern u32 _bss_start;
 extern u32 _bss_end;
 
+// the bootloader does not load the bss section, so it may contain garbage
+void clear_bss()
+{
+  for(u8* p = (u8*) &_bss_start; p < (u8*) &_bss_end; ++p)
+  {
+    *p = 0;
+  }
+}
+
 struct SegmentDescriptor 
 {
   u16 limit0;
@@ -119,21 +211,199 @@ struct TaskStateSegment
 } __attribute__((packed));
 
 #define PAGE_SIZE           4096
-struct TaskStateSegment tss __attribute__((aligned(PAGE_SIZE)));
-
 #define NUM_DESCRIPTORS 6
-union Descriptor gdt[NUM_DESCRIPTORS];
-struct GDTR gdtr;
 
-#define TSS_STACK_SIZE (1024 / 4)
+typedef u32 volatile Spinlock;
+
+void spin_lock(Spinlock* lock)
+{
+  while(__sync_lock_test_and_set(lock, 1))
+  {
+    while(*lock)
+    {
+      asm volatile ("pause");
+    }
+  }
+}
+
+void spin_unlock(Spinlock* lock)
+{
+  __sync_lock_release(lock);
+}
+
+struct Task;
+
+#define NUM_PRIORITIES   8 // 0 is the highest priority
+#define PRIORITY_DEFAULT 4
+
+// one queue per priority, a set bit in the bitmap marks a non-empty queue,
+// so the next task is found with a single bsf
+struct RunQueue
+{
+  Spinlock lock;
+  u32 bitmap;
+  struct Task* head[NUM_PRIORITIES];
+  struct Task* tail[NUM_PRIORITIES];
+  u32 length; // waiting tasks, the running task is not queued
+};
+
+#define MAX_CPUS 8
+#define KERNEL_STACK_SIZE (PAGE_SIZE / sizeof(u32))
+
+// hierarchical timer wheel, a slot of level l covers 32^l ticks,
+// so sleeping tasks are inserted and expired with a constant number of steps per tick
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOTS  32
+#define TIMER_WHEEL_BITS   5
+
+// every kernel stack is one page, its lowest word holds the cpu that runs on it,
+// so the kernel finds its cpu by rounding down the stack pointer,
+// the stack of a cpu is the stack of its idle task
+struct Cpu
+{
+  u32 stack[KERNEL_STACK_SIZE];
+  u32 id;
+  u32 apic_id;
+  u32 online;
+
+  union Descriptor gdt[NUM_DESCRIPTORS];
+  struct GDTR gdtr;
+  struct TaskStateSegment tss;
+
+  struct Task* task; // running task, the idle task if there is nothing to run
+  struct Task* idle;
+  struct Task* prev; // task switched away from, until schedule_tail
+  struct Task* fpu_owner; // task whose fpu state is loaded
+  u32 resched;            // set by a system call that gives up the cpu
+  struct TaskFrame* syscall_frame; // registers of the task in the running system call
+  u64 switch_start;
+  struct RunQueue run_queue;
+
+  struct Task* wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; // sleeping tasks by wakeup tick
+  u32 wheel_bitmap[TIMER_WHEEL_LEVELS];                      // non-empty slots
+  u64 wheel_next;                                            // next tick the wheel expires
+
+
+  u64 quantum_end;    // tick at which the running task is preempted
+  u64 timer_armed;    // tick the one-shot timer is armed for, 0 if not armed
+} __attribute__((aligned(PAGE_SIZE)));
+
+struct Cpu cpus[MAX_CPUS];
+u32 num_cpus = 1;
+
+// tracepoints write fixed size records with a tsc timestamp into a ring per cpu,
+// they are disabled by default and cost a load and a branch then
+#define TRACE_TIMER       1 // timer interrupt entry
+#define TRACE_TIMER_END   2 // arg: 1 if the running task is preempted
+#define TRACE_SWITCH      3 // task: previous task, arg: next task
+#define TRACE_SYSCALL     4 // arg: system call number
+#define TRACE_SYSCALL_END 5 // arg: return value
+#define TRACE_WAKE        6 // arg: woken task
+#define TRACE_FPU_TRAP    7
+#define TRACE_FAULT       8 // arg: exception vector
+#define TRACE_IRQ         9 // arg: irq
+#define TRACE_HALT        10
+#define TRACE_PAGE_FAULT  11 // arg: faulting address, a user page mapped on demand or the task killed
+
+// the trace rings live at a fixed physical address, so they can be dumped from the qemu monitor while the kernel runs
+// or after it halted: pmemsave 0x400000 0x81000 trace.bin, tools/trace.py turns the dump into a timeline
+#define TRACE_ADDR    0x400000
+#define TRACE_RECORDS 4096       // per cpu, power of two
+#define TRACE_MAGIC   0x45435254 // "TRCE"
+
+struct TraceRecord
+{
+  u64 tsc;
+  u16 event;
+  u16 task;
+  u32 arg;
+};
+
+struct TraceRing
+{
+  u32 volatile head; // records written so far, only written by the cpu that owns the ring
+  u32 reserved[15];  // head has its own cache line
+  struct TraceRecord records[TRACE_RECORDS];
+};
+
+struct TraceBuffer
+{
+  u32 magic;
+  u32 num_cpus;
+  u32 records;      // per cpu
+  u32 tsc_per_tick; // the decoder converts timestamps with these
+  u32 tick_hz;
+  u32 reserved[11];
+  struct TraceRing rings[MAX_CPUS];
+};
+
+// the sampling profiler counts the interrupted eip of every timer interrupt in a histogram over the kernel image,
+// which holds the user code as well. it lives at a fixed physical address like the trace:
+// pmemsave 0x500000 0x81000 profile.bin, tools/profile.py maps the buckets to the functions of main.sym
+#define PROFILE_ADDR         0x500000
+#define PROFILE_BUCKET_SHIFT 0      // one bucket per byte, functions are not aligned
+#define PROFILE_BUCKETS      131072 // covers 128 KiB of the image
+#define PROFILE_TASKS        64
+#define PROFILE_MAGIC        0x464f5250 // "PROF"
+
+struct Profile
+{
+  u32 magic;
+  u32 image_start;  // address of the first bucket
+  u32 bucket_shift;
+  u32 num_buckets;
+  u32 samples;
+  u32 outside;      // samples outside the buckets
+  u32 reserved[10];
+  u32 task_samples[PROFILE_TASKS]; // by task id, the idle task is 0
+  u32 buckets[PROFILE_BUCKETS];
+};
+
+u32 volatile profile_enabled;
 
-u32 tss_stack[TSS_STACK_SIZE];
+#define TRACE(cpu, event, arg) do { if(trace_enabled) trace(cpu, event, arg); } while(0)
+
+u32 volatile trace_enabled;
+void trace(struct Cpu* cpu, u32 event, u32 arg);
+
+// valid on a kernel stack, and on the boot stack once init_boot_cpu ran
+struct Cpu* cpu_current()
+{
+  u32 esp = 0;
+  asm volatile ("mov %%esp, %0" : "=r"(esp));
+  return *(struct Cpu**) (esp & ~(PAGE_SIZE - 1));
+}
+
+// the page of the boot stack names the bootstrap processor too, so interrupt handlers find it before the scheduler runs
+void init_boot_cpu()
+{
+  u32 esp = 0;
+  asm volatile ("mov %%esp, %0" : "=r"(esp));
+  *(struct Cpu**) (esp & ~(PAGE_SIZE - 1)) = &cpus[0];
+}
+
+void copy_u32(void* dst, void const* src, u32 count)
+{
+  asm volatile ("rep movsl" : "+D"(dst), "+S"(src), "+c"(count) : : "memory");
+}
+
+void fill_u32(void* dst, u32 val, u32 count)
+{
+  asm volatile ("rep stosl" : "+D"(dst), "+c"(count) : "a"(val) : "memory");
+}
 
 void outb(u16 port, u8 val)
 {
   asm volatile ( "outb %0, %1" : : "a"(val), "d"(port) );
 }
 
+u8 inb(u16 port)
+{
+  u8 val = 0;
+  asm volatile ( "inb %1, %0" : "=a"(val) : "d"(port) );
+  return val;
+}
+
 void remap_pic()
 {
   outb(0x20, 0x11);
@@ -152,6 +422,7 @@ void remap_pic()
 #define PT_NUM_ENTRIES      1024
 
 #define PAGE_DIR_SIZE       PAGE_SIZE * 1024
+#define LARGE_PAGE_SIZE     (PAGE_SIZE * 1024) // 4 MiB page, mapped by a single page directory entry
 
 #define PDE_PRESENT    ( 1 << 0 )
 #define PDE_WRITEABLE  ( 1 << 1 )
@@ -160,6 +431,7 @@ void remap_pic()
 #define PDE_PCD        ( 1 << 4 ) // page level cache disable
 #define PDE_ACCESSED   ( 1 << 5 )
 #define PDE_PS         ( 1 << 7 ) // page size, must be 0 for 4096 pages 
+#define PDE_GLOBAL     ( 1 << 8 ) // only for 4 MiB pages
 
 #define PTE_PRESENT    ( 1 << 0 )
 #define PTE_WRITEABLE  ( 1 << 1 )
@@ -170,654 +442,5728 @@ void remap_pic()
 #define PTE_DIRTY      ( 1 << 6 )
 #define PTE_PAT        ( 1 << 7 )
 #define PTE_GLOBAL     ( 1 << 8 )
+#define PTE_COW        ( 1 << 9 ) // available to software, read only until a write fault copies the frame
 
 typedef u32 PageDirectoryEntry; // PDE
 typedef u32 PageTableEntry;     // PTE
 
 // page directory needs to be 4096 byte aligned, because only 20 bits in cr3 are used to address the page directory
 PageDirectoryEntry page_dir[PD_NUM_ENTRIES] __attribute__((aligned(PAGE_SIZE)));
-// page table needs to be 4096 byte aligned, because only 20 bits in page directory entry are used to address the page table
-PageTableEntry     page_table_entries[PD_NUM_ENTRIES * PT_NUM_ENTRIES] __attribute__((aligned(PAGE_SIZE)));
 
 u32 round_down(u32 val, u32 low)
 {
   return (val / low) * low;
 }
 
-void enable_paging()
+u32 round_up(u32 val, u32 low)
 {
-  asm("push %eax");
-  asm("mov %cr0, %eax");
-  asm("or $0x80000000, %eax"); // set bit 31 of cr0 to enable paging
-  asm("mov %eax, %cr0");
-  asm("pop %eax");
+  return round_down(val + low - 1, low);
 }
 
-// cr3 bits 31:12 hold the physical address of the page directory
-void write_cr3(u32 val)
-{
-  asm volatile ("mov %0, %%cr3" :: "a" ( val ) );
-}
+// memory map as reported by the bios (int 0x15, eax = 0xe820), stored by the bootloader
+#define MEMORY_MAP_ADDR        0x500 // u32 number of entries, followed by the entries
+#define MEMORY_MAP_MAX_ENTRIES 32
+#define MEMORY_MAP_USABLE      1
 
-u32 read_cr3()
+struct MemoryMapEntry
 {
-  u32 cr3 = 0;
-  asm volatile ("mov %%cr3, %0" : "=a" ( cr3 ) );
-  return cr3;
-}
+  u64 base;
+  u64 length;
+  u32 type;
+  u32 acpi;
+} __attribute__((packed));
 
-void print_u32(u32 val)
-{
-  char buffer[10];
-  i32 i = 0;
+// physical frame allocator, one bit per frame, a set bit marks a used frame
+#define FRAME_MAX_MEMORY    0x3fc00000 // memory above is ignored, the last 4 MiB below 1 GiB map devices
+#define FRAME_NUM_FRAMES    (FRAME_MAX_MEMORY / PAGE_SIZE)
+#define FRAME_BITMAP_SIZE   (FRAME_NUM_FRAMES / 32)
+
+u32 frame_bitmap[FRAME_BITMAP_SIZE];
+u16 frame_shares[FRAME_NUM_FRAMES]; // address spaces that map a copy on write frame, besides the first one, more than MAX_TASKS never do
+u32 frame_search_idx; // no free frame below this bitmap word
+u32 frame_num_free;
+u32 frame_memory_end; // end of the highest usable memory region
+Spinlock frame_lock;
 
-  while(val > 0) 
+void frame_set(u32 frame)
+{
+  if(!(frame_bitmap[frame / 32] & (1 << (frame % 32))))
   {
-    buffer[i++] = '0' + (char)(val % 10);
-    val /= 10;
+    frame_bitmap[frame / 32] |= 1 << (frame % 32);
+    --frame_num_free;
   }
+}
 
-  buffer[i++] = '0' + (char)(val % 10);
-
-  while (i--)
+void frame_clear(u32 frame)
+{
+  if(frame_bitmap[frame / 32] & (1 << (frame % 32)))
   {
-    put_char(buffer[i]);
+    frame_bitmap[frame / 32] &= ~(1 << (frame % 32));
+    ++frame_num_free;
+
+    if(frame / 32 < frame_search_idx)
+    {
+      frame_search_idx = frame / 32;
+    }
   }
-    
-  put_char('\n');
 }
 
-void print_u32_hex(u32 val)
+// marks all frames touching [from, to) as used
+void frame_reserve(u32 from, u32 to)
 {
-  for(int i = 28; i >=0; i -= 4)
-  {
-  u8 c = (val >> i) & 0xf;
-  switch(c)
-  {
-  case 0:
-  case 1:
-  case 2:
-  case 3:
-  case 4:
-  case 5:
-  case 6:
-  case 7:
-  case 8:
-  case 9:
-  put_char(c + '0');
-  break;
-  case 10: put_char('a'); break;
-  case 11: put_char('b'); break;
-  case 12: put_char('c'); break;
-  case 13: put_char('d'); break;
-  case 14: put_char('e'); break;
-  case 15: put_char('f'); break;
-  }
+  for(u32 i = from / PAGE_SIZE; i < round_up(to, PAGE_SIZE) / PAGE_SIZE; ++i)
+  {
+    frame_set(i);
   }
-  put_char('\n');
 }
 
-void init_gdt()
+void init_frames()
 {
-  gdt[0].null.hi = 0;
-  gdt[0].null.lo = 0;
+  for(u32 i = 0; i < FRAME_BITMAP_SIZE; ++i)
+  {
+    frame_bitmap[i] = 0xffffffff;
+  }
 
-  // priviliged code 0x8
-  gdt[1].segment.limit0 = 0xffff;
-  gdt[1].segment.limit1 = 0xf;
+  u32 num_entries = *(u32*) MEMORY_MAP_ADDR;
+  struct MemoryMapEntry* entries = (struct MemoryMapEntry*) (MEMORY_MAP_ADDR + sizeof(u32));
 
-  gdt[1].segment.base0 = 0x0;
-  gdt[1].segment.base1 = 0x0;
-  gdt[1].segment.base2 = 0x0;
+  if(num_entries > MEMORY_MAP_MAX_ENTRIES)
+  {
+    num_entries = MEMORY_MAP_MAX_ENTRIES;
+  }
 
-  gdt[1].segment.flags0 = 0x9a;
-  gdt[1].segment.flags1 = 0xc;
+  for(u32 i = 0; i < num_entries; ++i)
+  {
+    struct MemoryMapEntry* entry = &entries[i];
 
-  // priviliged data 0x10
-  gdt[2].segment.limit0 = 0xffff;
-  gdt[2].segment.limit1 = 0xf;
+    if(entry->type != MEMORY_MAP_USABLE || entry->base >= FRAME_MAX_MEMORY)
+    {
+      continue;
+    }
 
-  gdt[2].segment.base0 = 0x0;
-  gdt[2].segment.base1 = 0x0;
-  gdt[2].segment.base2 = 0x0;
+    u64 end = entry->base + entry->length;
 
-  gdt[2].segment.flags0 = 0x92;
-  gdt[2].segment.flags1 = 0xc;
+    if(end > FRAME_MAX_MEMORY)
+    {
+      end = FRAME_MAX_MEMORY;
+    }
 
-  // user code 0x18
-  gdt[3].segment.limit0 = 0xffff;
-  gdt[3].segment.limit1 = 0xf;
+    // only frames that are completely usable
+    u32 from = round_up((u32) entry->base, PAGE_SIZE) / PAGE_SIZE;
+    u32 to = round_down((u32) end, PAGE_SIZE) / PAGE_SIZE;
 
-  gdt[3].segment.base0 = 0x0;
-  gdt[3].segment.base1 = 0x0;
-  gdt[3].segment.base2 = 0x0;
+    for(u32 frame = from; frame < to; ++frame)
+    {
+      frame_clear(frame);
+    }
 
-  gdt[3].segment.flags0 = 0xfa;
-  gdt[3].segment.flags1 = 0xc;
+    if(to * PAGE_SIZE > frame_memory_end)
+    {
+      frame_memory_end = to * PAGE_SIZE;
+    }
+  }
 
-  // user data 0x20
-  gdt[4].segment.limit0 = 0xffff;
-  gdt[4].segment.limit1 = 0xf;
+  // bios data, the bootloader, video memory and the kernel image are never handed out
+  frame_reserve(0, 0x100000);
+  frame_reserve((u32) &_text_start, (u32) &_bss_end);
+  frame_reserve(TRACE_ADDR, TRACE_ADDR + sizeof(struct TraceBuffer));
+  frame_reserve(PROFILE_ADDR, PROFILE_ADDR + sizeof(struct Profile));
 
-  gdt[4].segment.base0 = 0x0;
-  gdt[4].segment.base1 = 0x0;
-  gdt[4].segment.base2 = 0x0;
+  frame_search_idx = 0;
 
-  gdt[4].segment.flags0 = 0xf2;
-  gdt[4].segment.flags1 = 0xc;
+  print("free frames:");
+  print_u32(frame_num_free);
+}
 
-  // tss 0x28
-  gdt[5].segment.limit0 = ((sizeof(struct TaskStateSegment) - 1) >>  0) & 0xffff;
-  gdt[5].segment.limit1 = ((sizeof(struct TaskStateSegment) - 1) >> 16) & 0x000f;
+// returns the physical address of a free frame or 0 if out of memory
+u32 frame_alloc()
+{
+  spin_lock(&frame_lock);
 
-  gdt[5].segment.base0 = ((u32)(&tss) >>  0) & 0xffff;
-  gdt[5].segment.base1 = ((u32)(&tss) >> 16) & 0x000f;
-  gdt[5].segment.base2 = ((u32)(&tss) >> 24) & 0x000f;
+  for(u32 i = frame_search_idx; i < FRAME_BITMAP_SIZE; ++i)
+  {
+    if(frame_bitmap[i] != 0xffffffff)
+    {
+      u32 bit = 0;
+      asm volatile ("bsf %1, %0" : "=r"(bit) : "r"(~frame_bitmap[i]));
 
-  gdt[5].segment.flags0 = 0x89;
-  gdt[5].segment.flags1 = 0x0;
+      frame_bitmap[i] |= 1 << bit;
+      --frame_num_free;
+      frame_search_idx = i;
 
-  // gdtr
-  gdtr.limit = sizeof(union Descriptor) * NUM_DESCRIPTORS - 1;
-  gdtr.base = (u32) gdt;
+      spin_unlock(&frame_lock);
+      return (i * 32 + bit) * PAGE_SIZE;
+    }
+  }
 
-  // tss
-  tss.ss0 = 0x10; // priviliged data segment descriptor selector
-  tss.esp0 = (u32) &tss_stack[TSS_STACK_SIZE - 1];
-  tss.cr3 = (u32) &page_dir;
+  frame_search_idx = FRAME_BITMAP_SIZE;
 
-  // load gdt, segment registers and task register
-  asm volatile ("lgdt (%0);" :: "a"((u32) &gdtr));
-  asm volatile ("    \
-    push %eax;       \
-    mov $0x10, %eax; \
-    mov %eax, %ds;   \
-    mov %eax, %es;   \
-    mov %eax, %fs;   \
-    mov %eax, %gs;   \
-    mov %eax, %ss;   \
-    mov $0x28, %ax;  \
-    ltr %ax;         \
-    pop %eax;        \
-    ");
+  spin_unlock(&frame_lock);
+  return 0;
 }
 
-void init_paging()
+// a shared frame is only freed once the last address space drops it
+void frame_free(u32 addr)
 {
-  // set page table for each page direcory entry 
-  for(u32 i = 0; i < PD_NUM_ENTRIES; ++i)
+  spin_lock(&frame_lock);
+
+  if(frame_shares[addr / PAGE_SIZE])
   {
-    page_dir[i] = (u32) &page_table_entries[i * PT_NUM_ENTRIES];
+    --frame_shares[addr / PAGE_SIZE];
+  }
+  else
+  {
+    frame_clear(addr / PAGE_SIZE);
   }
 
-  u32 to = round_down((u32)&_bss_end, PAGE_SIZE) + PAGE_SIZE; // exclusive
+  spin_unlock(&frame_lock);
+}
 
-  for(u32 i = 0; i < to; i += PAGE_SIZE)
-  {
-    u32 pdIdx = (i >> 22) & 0x3ff;
-    u32 ptIdx = (i >> 12) & 0x3ff;
+void frame_share(u32 addr)
+{
+  spin_lock(&frame_lock);
+  ++frame_shares[addr / PAGE_SIZE];
+  spin_unlock(&frame_lock);
+}
 
-    u32 *pde = &page_dir[pdIdx];
-    u32 *pt = (u32*) (*pde & 0xfffff000);
-    u32 *pte = &pt[ptIdx];
+void zero_page(u32 addr)
+{
+  u32* p = (u32*) addr;
 
-    *pde |= PDE_PRESENT | PTE_WRITEABLE | PTE_USER;
-    *pte = i | PTE_PRESENT | PTE_WRITEABLE | PTE_USER;
+  for(u32 i = 0; i < PAGE_SIZE / sizeof(u32); ++i)
+  {
+    p[i] = 0;
   }
-
-  write_cr3( (u32) &page_dir );
-  enable_paging();
 }
 
-struct InterruptDescriptor
+// kernel heap, objects of one size come from a slab cache, a slab is one frame with its header in front of the objects,
+// free objects are linked through their first word and a freed object finds its slab from the page it is in
+#define CACHE_LINE 64
+
+struct SlabCache;
+
+struct Slab
 {
-  u16 offset0;
-  u16 selector;
-  u16 flags;
-  u16 offset1;
+  struct SlabCache* cache;
+  struct Slab* prev; // partial slabs of the cache
+  struct Slab* next;
+  void* free;        // first free object, 0 if the slab is full
+  u32 used;          // allocated objects
 };
 
-// interrupt descriptor table register
-struct IDTR
+struct SlabCache
 {
-  u16 limit;
-  u32 base;
-} __attribute__((packed));
+  Spinlock lock;
+  u32 size;                   // object size rounded up to the alignment
+  u32 offset;                 // of the first object in a slab
+  u32 per_slab;
+  void (*ctor)(void* object); // optional, runs once for every object when its slab is carved, must leave the first word alone
+  struct Slab* partial;       // slabs with free objects, full slabs are only found through their objects
+  u32 slabs;
+  u32 objects;                // allocated
+} __attribute__((aligned(CACHE_LINE))); // caches on different cpus do not share lines
 
-#define NUM_INTERRUPT_DESCRIPTORS 256
-struct InterruptDescriptor interrupt_descriptor_table[NUM_INTERRUPT_DESCRIPTORS];
-struct IDTR idtr;
+// align is a power of two, CACHE_LINE keeps objects from sharing cache lines
+void slab_cache_init(struct SlabCache* cache, u32 size, u32 align, void (*ctor)(void*))
+{
+  if(align < sizeof(void*))
+  {
+    align = sizeof(void*);
+  }
 
-struct ir_frame;
+  fill_u32(cache, 0, sizeof(struct SlabCache) / sizeof(u32));
+  cache->size     = round_up(size, align);
+  cache->offset   = round_up(sizeof(struct Slab), align);
+  cache->per_slab = (PAGE_SIZE - cache->offset) / cache->size;
+  cache->ctor     = ctor;
+}
 
-__attribute__((interrupt)) void default_interrupt_handler(struct ir_frame* f)
+// carves a new frame into objects and makes it the first partial slab, the cache is locked
+struct Slab* slab_grow(struct SlabCache* cache)
 {
-  print("Default interrupt handler.\n");
-  while(1);
+  struct Slab* slab = (struct Slab*) frame_alloc();
+
+  if(slab == 0)
+  {
+    return 0;
+  }
+
+  slab->cache = cache;
+  slab->prev  = 0;
+  slab->next  = cache->partial;
+  slab->free  = 0;
+  slab->used  = 0;
+
+  // linked backwards, so objects are handed out in address order
+  for(u32 i = cache->per_slab; i > 0; --i)
+  {
+    void** object = (void**) ((u32) slab + cache->offset + (i - 1) * cache->size);
+
+    if(cache->ctor)
+    {
+      cache->ctor(object);
+    }
+
+    *object = slab->free;
+    slab->free = object;
+  }
+
+  if(cache->partial)
+  {
+    cache->partial->prev = slab;
+  }
+
+  cache->partial = slab;
+  ++cache->slabs;
+
+  return slab;
 }
-__attribute__((interrupt)) void ir0(struct ir_frame* f)
+
+void slab_unlink(struct SlabCache* cache, struct Slab* slab)
 {
-  print("ir0\n");
-  while(1);
+  if(slab->prev)
+  {
+    slab->prev->next = slab->next;
+  }
+  else
+  {
+    cache->partial = slab->next;
+  }
+
+  if(slab->next)
+  {
+    slab->next->prev = slab->prev;
+  }
 }
-__attribute__((interrupt)) void ir1(struct ir_frame* f)
+
+// returns 0 if out of memory
+void* slab_alloc(struct SlabCache* cache)
 {
-  print("ir1\n");
-  while(1);
+  spin_lock(&cache->lock);
+
+  struct Slab* slab = cache->partial;
+
+  if(slab == 0)
+  {
+    slab = slab_grow(cache);
+
+    if(slab == 0)
+    {
+      spin_unlock(&cache->lock);
+      return 0;
+    }
+  }
+
+  void** object = slab->free;
+
+  slab->free = *object;
+  ++slab->used;
+  ++cache->objects;
+
+  if(slab->free == 0)
+  {
+    slab_unlink(cache, slab);
+  }
+
+  spin_unlock(&cache->lock);
+  return object;
 }
-__attribute__((interrupt)) void ir2(struct ir_frame* f)
+
+// an empty slab goes back to the frame allocator unless it is the last partial one
+void slab_free(void* object)
 {
-  print("ir2\n");
-  while(1);
+  struct Slab* slab = (struct Slab*) round_down((u32) object, PAGE_SIZE);
+  struct SlabCache* cache = slab->cache;
+
+  spin_lock(&cache->lock);
+
+  if(slab->free == 0)
+  {
+    slab->prev = 0;
+    slab->next = cache->partial;
+
+    if(cache->partial)
+    {
+      cache->partial->prev = slab;
+    }
+
+    cache->partial = slab;
+  }
+
+  *(void**) object = slab->free;
+  slab->free = object;
+  --slab->used;
+  --cache->objects;
+
+  if(slab->used == 0 && (slab->prev || slab->next))
+  {
+    slab_unlink(cache, slab);
+    --cache->slabs;
+    frame_free((u32) slab);
+  }
+
+  spin_unlock(&cache->lock);
 }
-__attribute__((interrupt)) void ir3(struct ir_frame* f)
+
+// general allocations are rounded up to a size class from 16 to KMALLOC_MAX bytes, a class starts at a power of two
+// and grows to share the room behind the slab header evenly among the objects that fit, so a slab never wastes
+// a whole object, the largest class holds two objects instead of one of 2048 bytes
+#define KMALLOC_MIN_SHIFT 4
+#define KMALLOC_CACHES    8
+#define KMALLOC_MAX       (((PAGE_SIZE - CACHE_LINE) / 2) & ~(CACHE_LINE - 1)) // 1984
+
+struct SlabCache kmalloc_caches[KMALLOC_CACHES];
+
+// returns 0 if out of memory or for more than KMALLOC_MAX bytes, whole pages come from frame_alloc
+void* kmalloc(u32 size)
 {
-  print("ir3\n");
-  while(1);
+  if(size > KMALLOC_MAX)
+  {
+    return 0;
+  }
+
+  for(u32 i = 0; i < KMALLOC_CACHES; ++i)
+  {
+    if(size <= kmalloc_caches[i].size)
+    {
+      return slab_alloc(&kmalloc_caches[i]);
+    }
+  }
+
+  return 0;
 }
-__attribute__((interrupt)) void ir4(struct ir_frame* f)
+
+void kfree(void* object)
 {
-  print("ir4\n");
-  while(1);
+  slab_free(object);
 }
-__attribute__((interrupt)) void ir5(struct ir_frame* f)
+
+// fxsave images of the tasks, fxsave needs 16 byte alignment
+#define FPU_STATE_SIZE 512
+
+struct SlabCache fpu_state_cache;
+
+u8* fpu_state_alloc()
 {
-  print("ir5\n");
-  while(1);
+  u8* state = slab_alloc(&fpu_state_cache);
+
+  if(state == 0)
+  {
+    print("out of memory\n");
+    halt();
+  }
+
+  return state;
 }
-__attribute__((interrupt)) void ir6(struct ir_frame* f)
+
+void init_slab()
 {
-  print("ir6: invalid opcode exception\n");
-  while(1);
+  for(u32 i = 0; i < KMALLOC_CACHES; ++i)
+  {
+    u32 size = 1 << (KMALLOC_MIN_SHIFT + i);
+    u32 align = size < CACHE_LINE ? size : CACHE_LINE;
+    u32 room = PAGE_SIZE - round_up(sizeof(struct Slab), align);
+    u32 per_slab = room / size < 2 ? 2 : room / size;
+
+    slab_cache_init(&kmalloc_caches[i], round_down(room / per_slab, align), align, 0);
+  }
+
+  slab_cache_init(&fpu_state_cache, FPU_STATE_SIZE, 16, 0);
 }
-__attribute__((interrupt)) void ir7(struct ir_frame* f)
+
+void enable_paging()
 {
-  print("ir7\n");
-  while(1);
+  asm("push %eax");
+  asm("mov %cr0, %eax");
+  asm("or $0x80010000, %eax"); // set bit 31 of cr0 to enable paging, bit 16 makes read only user pages read only for the kernel too
+  asm("mov %eax, %cr0");
+  asm("pop %eax");
 }
-__attribute__((interrupt)) void ir8(struct ir_frame* f)
+
+#define CR0_MP ( 1 << 1 ) // wait honors cr0.ts
+#define CR0_EM ( 1 << 2 ) // no fpu, every fpu instruction raises #NM
+#define CR0_TS ( 1 << 3 ) // task switched, the next fpu or sse instruction raises #NM
+#define CR0_NE ( 1 << 5 ) // fpu errors raise #MF instead of an external interrupt
+
+void write_cr0(u32 val)
 {
-  print("ir8\n");
-  while(1);
+  asm volatile ("mov %0, %%cr0" :: "a" ( val ) );
 }
-__attribute__((interrupt)) void ir9(struct ir_frame* f)
+
+u32 read_cr0()
 {
-  print("ir9\n");
-  while(1);
+  u32 cr0 = 0;
+  asm volatile ("mov %%cr0, %0" : "=a" ( cr0 ) );
+  return cr0;
 }
-__attribute__((interrupt)) void ir10(struct ir_frame* f)
+
+// cr2 holds the linear address of the last page fault
+u32 read_cr2()
 {
-  print("ir10\n");
-  while(1);
+  u32 cr2 = 0;
+  asm volatile ("mov %%cr2, %0" : "=a" ( cr2 ) );
+  return cr2;
 }
-__attribute__((interrupt)) void ir11(struct ir_frame* f)
+
+// cr3 bits 31:12 hold the physical address of the page directory
+void write_cr3(u32 val)
 {
-  print("ir11: invalid TSS exception\n");
-  while(1);
+  asm volatile ("mov %0, %%cr3" :: "a" ( val ) );
 }
-__attribute__((interrupt)) void ir12(struct ir_frame* f)
+
+u32 read_cr3()
 {
-  print("ir12\n");
-  while(1);
+  u32 cr3 = 0;
+  asm volatile ("mov %%cr3, %0" : "=a" ( cr3 ) );
+  return cr3;
 }
-__attribute__((interrupt)) void ir13(struct ir_frame* f)
-{
-  print("ir13: general protection fault\n");
 
-  u32 volatile error = 0;
-  asm volatile ("mov 0x4(%%ebp), %0" : "=r"(error) );
-  print("error code:");
-  print_u32_hex(error);
+#define CR4_PSE        ( 1 << 4 )  // 4 MiB pages
+#define CR4_PGE        ( 1 << 7 )  // global pages
+#define CR4_OSFXSR     ( 1 << 9 )  // fxsave and fxrstor include the sse state, sse instructions are enabled
+#define CR4_OSXMMEXCPT ( 1 << 10 ) // unmasked sse exceptions raise #XM
 
-  print("ext:");
-  print_u32((error >> 0) & 0x1);
-  print("idt:");
-  print_u32((error >> 1) & 0x1);
-  print("ti:");
-  print_u32((error >> 2) & 0x1);
-  print("segment selector index:");
-  print_u32(error >> 3);
-
-  u32 volatile eip = 0;
-  asm volatile ("mov 0x8(%%ebp), %0" : "=r"(eip) );
-  print("eip:");
-  print_u32_hex(eip);
+void write_cr4(u32 val)
+{
+  asm volatile ("mov %0, %%cr4" :: "a" ( val ) );
+}
 
-  while(1);
+u32 read_cr4()
+{
+  u32 cr4 = 0;
+  asm volatile ("mov %%cr4, %0" : "=a" ( cr4 ) );
+  return cr4;
+}
+
+#define CPUID_EDX_PSE  ( 1 << 3 )
+#define CPUID_EDX_PGE  ( 1 << 13 )
+#define CPUID_EDX_FXSR ( 1 << 24 )
+#define CPUID_EDX_SSE  ( 1 << 25 )
 
-  // TODO: pop error code off the stack
+void cpuid(u32 leaf, u32* eax, u32* ebx, u32* ecx, u32* edx)
+{
+  asm volatile ("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
 }
-__attribute__((interrupt)) void ir14(struct ir_frame* f)
+
+void put_u32(u32 val)
 {
-  print("ir14: page fault\n");
+  char buffer[10];
+  i32 i = 10;
 
-  u32 volatile error = 0;
-  asm volatile ("mov 0x4(%%ebp), %0" : "=r"(error) );
-  print("error code:");
-  print_u32_hex(error);
+  do
+  {
+    buffer[--i] = '0' + (char)(val % 10);
+    val /= 10;
+  }
+  while(val > 0);
 
-  print("p:");
-  print_u32_hex((error >> 0) & 0x1);
-  print("w/r:");
-  print_u32_hex((error >> 1) & 0x1);
-  print("u/s:");
-  print_u32_hex((error >> 2) & 0x1);
-  print("rsvd:");
-  print_u32_hex((error >> 3) & 0x1);
-  print("i/d:");
-  print_u32_hex((error >> 4) & 0x1);
-  print("pk:");
-  print_u32_hex((error >> 5) & 0x1);
-  print("ss:");
-  print_u32_hex((error >> 6) & 0x1);
-  print("sgx:");
-  print_u32_hex((error >> 15) & 0x1);
+  console_write(buffer + i, 10 - i);
+}
 
-  u32 volatile eip = 0;
-  asm volatile ("mov 0x8(%%ebp), %0" : "=r"(eip) );
-  print("eip:");
-  print_u32_hex(eip);
+void print_u32(u32 val)
+{
+  put_u32(val);
+  put_char('\n');
+}
 
-  while(1);
+void print_u32_hex(u32 val)
+{
+  char buffer[9];
+
+  for(int i = 0; i < 8; ++i)
+  {
+    u8 c = (val >> (28 - i * 4)) & 0xf;
+    buffer[i] = c < 10 ? c + '0' : c - 10 + 'a';
+  }
 
-  // TODO: pop error code off the stack
+  buffer[8] = '\n';
+  console_write(buffer, 9);
 }
-__attribute__((interrupt)) void ir15(struct ir_frame* f)
+
+USER u64 rdtsc()
 {
-  print("ir15\n");
-  while(1);
+  u32 lo = 0;
+  u32 hi = 0;
+  asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((u64) hi << 32) | lo;
 }
-__attribute__((interrupt)) void ir16(struct ir_frame* f)
+
+// 64 by 32 bit division, without libgcc there is no __udivdi3
+u64 div_u64(u64 val, u32 div)
 {
-  print("ir16\n");
-  while(1);
+  u32 hi = (u32) (val >> 32);
+  u32 lo = (u32) val;
+  u32 q_hi = hi / div;
+  u32 q_lo = 0;
+  u32 r = hi % div;
+
+  asm ("divl %4" : "=a"(q_lo), "=d"(r) : "0"(lo), "1"(r), "rm"(div));
+
+  return ((u64) q_hi << 32) | q_lo;
 }
-__attribute__((interrupt)) void ir17(struct ir_frame* f)
+
+struct CycleStats
 {
-  print("ir17\n");
-  while(1);
-}
-__attribute__((interrupt)) void ir18(struct ir_frame* f)
+  u32 min;
+  u32 max;
+  u64 total;
+  u32 count;
+};
+
+USER void stats_reset(struct CycleStats* s)
 {
-  print("ir18\n");
-  while(1);
+  s->min = 0xffffffff;
+  s->max = 0;
+  s->total = 0;
+  s->count = 0;
 }
-__attribute__((interrupt)) void ir19(struct ir_frame* f)
+
+USER void stats_add(struct CycleStats* s, u32 cycles)
 {
-  print("ir19\n");
-  while(1);
+  if(cycles < s->min) s->min = cycles;
+  if(cycles > s->max) s->max = cycles;
+  s->total += cycles;
+  ++s->count;
 }
-__attribute__((interrupt)) void ir20(struct ir_frame* f)
+
+void stats_merge(struct CycleStats* s, struct CycleStats* other)
 {
-  print("ir20\n");
-  while(1);
+  if(other->min < s->min) s->min = other->min;
+  if(other->max > s->max) s->max = other->max;
+  s->total += other->total;
+  s->count += other->count;
 }
-__attribute__((interrupt)) void ir21(struct ir_frame* f)
+
+// benchmark results are single lines, "bench", the name and key:value pairs, so tools/bench.py can collect them
+void print_result(char const* name, char const* key, u32 value)
 {
-  print("ir21\n");
-  while(1);
+  print("bench ");
+  print(name);
+  print(" ");
+  print(key);
+  print(":");
+  print_u32(value);
 }
 
-u32 read_addr(u32 addr)
+void put_stats(struct CycleStats* s)
 {
-  return *((u32*) addr);
+  print(" n:");
+  put_u32(s->count);
+  print(" min:");
+  put_u32(s->count ? s->min : 0);
+  print(" avg:");
+  put_u32(s->count ? (u32) div_u64(s->total, s->count) : 0);
+  print(" max:");
+  put_u32(s->max);
+  put_char('\n');
 }
 
-void write_addr(u32 addr, u32 val)
+void print_stats(char const* name, struct CycleStats* s)
 {
-  *((u32*) addr) = val;
+  print("bench ");
+  print(name);
+  put_stats(s);
 }
 
-#define TASK_STACK_SIZE (PAGE_SIZE / sizeof(u32))
-#define NUM_TASKS 10
-struct Task
+void init_cpu_gdt(struct Cpu* cpu)
 {
-  u32 stack[TASK_STACK_SIZE] __attribute__((aligned(PAGE_SIZE)));
-  u32 id;
-  u32 cr3;
+  cpu->gdt[0].null.hi = 0;
+  cpu->gdt[0].null.lo = 0;
 
-  u32 eip;
-  u32 cs;
-  u32 eflags;
-  u32 esp;
-  u32 ss;
+  // priviliged code 0x8
+  cpu->gdt[1].segment.limit0 = 0xffff;
+  cpu->gdt[1].segment.limit1 = 0xf;
 
-  u32 eax;
-  u32 ecx;
-  u32 edx;
-  u32 ebx;
-  u32 ebp;
-  u32 esi;
-  u32 edi;
-};
+  cpu->gdt[1].segment.base0 = 0x0;
+  cpu->gdt[1].segment.base1 = 0x0;
+  cpu->gdt[1].segment.base2 = 0x0;
+
+  cpu->gdt[1].segment.flags0 = 0x9a;
+  cpu->gdt[1].segment.flags1 = 0xc;
+
+  // priviliged data 0x10
+  cpu->gdt[2].segment.limit0 = 0xffff;
+  cpu->gdt[2].segment.limit1 = 0xf;
+
+  cpu->gdt[2].segment.base0 = 0x0;
+  cpu->gdt[2].segment.base1 = 0x0;
+  cpu->gdt[2].segment.base2 = 0x0;
 
-struct Task tasks[NUM_TASKS];
-u32 active_task_idx;
+  cpu->gdt[2].segment.flags0 = 0x92;
+  cpu->gdt[2].segment.flags1 = 0xc;
 
-__attribute__((naked)) void user_mode()
+  // user code 0x18
+  cpu->gdt[3].segment.limit0 = 0xffff;
+  cpu->gdt[3].segment.limit1 = 0xf;
+
+  cpu->gdt[3].segment.base0 = 0x0;
+  cpu->gdt[3].segment.base1 = 0x0;
+  cpu->gdt[3].segment.base2 = 0x0;
+
+  cpu->gdt[3].segment.flags0 = 0xfa;
+  cpu->gdt[3].segment.flags1 = 0xc;
+
+  // user data 0x20
+  cpu->gdt[4].segment.limit0 = 0xffff;
+  cpu->gdt[4].segment.limit1 = 0xf;
+
+  cpu->gdt[4].segment.base0 = 0x0;
+  cpu->gdt[4].segment.base1 = 0x0;
+  cpu->gdt[4].segment.base2 = 0x0;
+
+  cpu->gdt[4].segment.flags0 = 0xf2;
+  cpu->gdt[4].segment.flags1 = 0xc;
+
+  // tss 0x28
+  cpu->gdt[5].segment.limit0 = ((sizeof(struct TaskStateSegment) - 1) >>  0) & 0xffff;
+  cpu->gdt[5].segment.limit1 = ((sizeof(struct TaskStateSegment) - 1) >> 16) & 0x000f;
+
+  cpu->gdt[5].segment.base0 = ((u32)(&cpu->tss) >>  0) & 0xffff;
+  cpu->gdt[5].segment.base1 = ((u32)(&cpu->tss) >> 16) & 0x00ff;
+  cpu->gdt[5].segment.base2 = ((u32)(&cpu->tss) >> 24) & 0x00ff;
+
+  cpu->gdt[5].segment.flags0 = 0x89;
+  cpu->gdt[5].segment.flags1 = 0x0;
+
+  // gdtr
+  cpu->gdtr.limit = sizeof(union Descriptor) * NUM_DESCRIPTORS - 1;
+  cpu->gdtr.base = (u32) cpu->gdt;
+
+  // tss
+  cpu->tss.ss0 = 0x10; // priviliged data segment descriptor selector
+  cpu->tss.esp0 = (u32) &cpu->stack[KERNEL_STACK_SIZE];
+  cpu->tss.cr3 = (u32) &page_dir;
+
+  // load gdt, segment registers and task register
+  asm volatile ("lgdt (%0);" :: "a"((u32) &cpu->gdtr));
+  asm volatile ("    \
+    push %eax;       \
+    mov $0x10, %eax; \
+    mov %eax, %ds;   \
+    mov %eax, %es;   \
+    mov %eax, %fs;   \
+    mov %eax, %gs;   \
+    mov %eax, %ss;   \
+    mov $0x28, %ax;  \
+    ltr %ax;         \
+    pop %eax;        \
+    ");
+}
+
+void init_gdt()
 {
-  int i = 0;
-  u32 id = tasks[active_task_idx].id;
-  while(1)
+  init_cpu_gdt(&cpus[0]);
+}
+
+// page tables are allocated from the frame allocator when a page directory entry is first used,
+// all frames are identity mapped, so the kernel can access page tables with paging enabled
+void map_page(PageDirectoryEntry* dir, u32 virt, u32 phys, u32 flags)
+{
+  u32 pdIdx = (virt >> 22) & 0x3ff;
+  u32 ptIdx = (virt >> 12) & 0x3ff;
+
+  u32 *pde = &dir[pdIdx];
+
+  if(!(*pde & PDE_PRESENT) || (*pde & PDE_PS))
   {
-    ++i;
-    if( i > 1000000 * id) 
+    u32 pt = frame_alloc();
+
+    if(pt == 0)
+    {
+      print("out of memory\n");
+      halt();
+    }
+
+    zero_page(pt);
+
+    // split a 4 MiB page, the new page table keeps the old mapping for the rest of the 4 MiB
+    if(*pde & PDE_PS)
     {
-      print_u32_hex(id);
-      i = 0; 
+      for(u32 i = 0; i < PT_NUM_ENTRIES; ++i)
+      {
+        ((u32*) pt)[i] = ((*pde & 0xffc00000) + i * PAGE_SIZE) | (*pde & (PTE_WRITEABLE | PTE_USER | PTE_GLOBAL)) | PTE_PRESENT;
+      }
     }
+
+    *pde = pt | (*pde & (PDE_WRITEABLE | PDE_USER)) | PDE_PRESENT;
   }
-}
 
-void init_task(struct Task* task, u32 id, u32 eip)
-{
-  task->id     = id;
-  task->ss     = 0x23;
-  task->esp    = (u32) &task->stack[TASK_STACK_SIZE - 1];
-  task->eflags = 0;
-  task->cs     = 0x1b;
-  task->eip    = eip;
+  u32 *pt = (u32*) (*pde & 0xfffff000);
+  u32 *pte = &pt[ptIdx];
+
+  *pde |= flags & (PDE_WRITEABLE | PDE_USER);
+  *pte = (phys & 0xfffff000) | flags | PTE_PRESENT;
 }
 
-void init_tasks()
+// removes the mapping of a 4 KiB page, returns the physical address it mapped or 0,
+// the tlb entry is only invalidated if dir is the loaded address space
+u32 unmap_page(PageDirectoryEntry* dir, u32 virt)
 {
-  for(u32 i = 0; i < NUM_TASKS; ++i)
+  u32 pde = dir[(virt >> 22) & 0x3ff];
+
+  if(!(pde & PDE_PRESENT) || (pde & PDE_PS))
   {
-    init_task(&tasks[i], i + 1, (u32) user_mode);
+    return 0;
   }
-}
 
-u32 esp = 0;
+  u32 *pte = &((u32*) (pde & 0xfffff000))[(virt >> 12) & 0x3ff];
+  u32 phys = *pte & PTE_PRESENT ? *pte & 0xfffff000 : 0;
 
-__attribute__((naked)) void task_switch()
-{
-  asm volatile("pusha; mov %%esp, %0;" : "=r"(esp));
+  *pte = 0;
 
-  tasks[active_task_idx].edi    = read_addr(esp + 0);
-  tasks[active_task_idx].esi    = read_addr(esp + 4);
-  tasks[active_task_idx].ebp    = read_addr(esp + 8);
-  tasks[active_task_idx].ebx    = read_addr(esp + 16);
-  tasks[active_task_idx].edx    = read_addr(esp + 20);
-  tasks[active_task_idx].ecx    = read_addr(esp + 24);
-  tasks[active_task_idx].eax    = read_addr(esp + 28);
+  if(read_cr3() == (u32) dir)
+  {
+    asm volatile ("invlpg (%0)" :: "r"(virt) : "memory");
+  }
 
-  tasks[active_task_idx].eip    = read_addr(esp + 32);
-  tasks[active_task_idx].cs     = read_addr(esp + 36);
-  tasks[active_task_idx].eflags = read_addr(esp + 40);
-  tasks[active_task_idx].esp    = read_addr(esp + 44);
-  tasks[active_task_idx].ss     = read_addr(esp + 48);
+  return phys;
+}
 
-  active_task_idx = (active_task_idx + 1) % NUM_TASKS;
+u32 paging_large_pages = 1; // map kernel memory with global 4 MiB pages, if the cpu supports it
 
-  write_addr(esp + 0,  tasks[active_task_idx].edi);
-  write_addr(esp + 4,  tasks[active_task_idx].esi);
-  write_addr(esp + 8,  tasks[active_task_idx].ebp);
-  write_addr(esp + 16, tasks[active_task_idx].ebx);
-  write_addr(esp + 20, tasks[active_task_idx].edx);
-  write_addr(esp + 24, tasks[active_task_idx].ecx);
-  write_addr(esp + 28, tasks[active_task_idx].eax);
+// identity maps [from, to), whole 4 MiB blocks with a single page directory entry if large pages are enabled
+void map_identity(PageDirectoryEntry* dir, u32 from, u32 to, u32 flags)
+{
+  u32 addr = from;
 
-  write_addr(esp + 32, tasks[active_task_idx].eip);
-  write_addr(esp + 36, tasks[active_task_idx].cs);
-  write_addr(esp + 40, tasks[active_task_idx].eflags | 0x200);
-  write_addr(esp + 44, tasks[active_task_idx].esp);
-  write_addr(esp + 48, tasks[active_task_idx].ss);
+  while(addr < to)
+  {
+    u32 *pde = &dir[(addr >> 22) & 0x3ff];
 
-  asm volatile("popa;");
-  asm volatile ("iret");
-}
+    if(paging_large_pages && addr % LARGE_PAGE_SIZE == 0 && to - addr >= LARGE_PAGE_SIZE)
+    {
+      if((*pde & PDE_PRESENT) && !(*pde & PDE_PS))
+      {
+        frame_free(*pde & 0xfffff000);
+      }
 
-__attribute__((naked)) void timer_interrupt_handler()
-{
-  asm volatile("cli;"); // will be enabled again by setting EFLAGS.IF in task_switch
-  asm volatile("push %eax");
-  asm volatile("mov $0x20, %al");
-  asm volatile("outb %al, $0x20"); // end of interrupt pic1, expected by the pic master
-  asm volatile("outb %al, $0xa0"); // end of interrupt pic2, for pic slave, not always needed
-  asm volatile("pop %eax");
-  asm volatile("jmp task_switch;");
+      *pde = addr | flags | PDE_PS | PDE_PRESENT;
+      addr += LARGE_PAGE_SIZE;
+    }
+    else
+    {
+      map_page(dir, addr, addr, flags);
+      addr += PAGE_SIZE;
+    }
+  }
 }
 
-void enable_interrupts(u32 pIDTR)
-{
-  asm volatile ("lidt (%0);" :: "a"(pIDTR)); // EFLAGS.IF will be set with the first task switch 
-}
+#define VGA_MEMORY_START 0xb8000
+#define VGA_MEMORY_END   0xc0000
 
-void set_interrupt_handler(u8 idx, u32 handler)
+void init_paging()
 {
-    struct InterruptDescriptor* id = &interrupt_descriptor_table[idx];
+  u32 eax, ebx, ecx, edx;
+  cpuid(1, &eax, &ebx, &ecx, &edx);
 
-    id->selector = 0x0008; // code segment
-    id->offset0  = 0x0000ffff & handler;
-    id->offset1  = 0xffff0000 & handler;
-    id->flags    = 0x8e00; // type of descriptor (32 bit interrupt call gate)
-}
+  if(!(edx & CPUID_EDX_PSE) || !(edx & CPUID_EDX_PGE))
+  {
+    paging_large_pages = 0;
+  }
 
-void init_interrupt_handlers()
-{
-  remap_pic(); // pic master: 32-39, pic slave: 40-47 
+  u32 global = 0;
 
-  for(int i = 0; i < NUM_INTERRUPT_DESCRIPTORS; ++i)
+  if(paging_large_pages)
   {
-    set_interrupt_handler(i, (u32) default_interrupt_handler);
-  }
-
-  set_interrupt_handler(0, (u32) ir0);
-  set_interrupt_handler(1, (u32) ir1);
-  set_interrupt_handler(2, (u32) ir2);
-  set_interrupt_handler(3, (u32) ir3);
-  set_interrupt_handler(4, (u32) ir4);
-  set_interrupt_handler(5, (u32) ir5);
-  set_interrupt_handler(6, (u32) ir6);
-  set_interrupt_handler(7, (u32) ir7);
-  set_interrupt_handler(8, (u32) ir8);
-  set_interrupt_handler(9, (u32) ir9);
-  set_interrupt_handler(10, (u32) ir10);
-  set_interrupt_handler(11, (u32) ir11);
-  set_interrupt_handler(12, (u32) ir12);
-  set_interrupt_handler(13, (u32) ir13);
-  set_interrupt_handler(14, (u32) ir14);
-  set_interrupt_handler(15, (u32) ir15);
-  set_interrupt_handler(16, (u32) ir16);
-  set_interrupt_handler(17, (u32) ir17);
-  set_interrupt_handler(18, (u32) ir18);
-  set_interrupt_handler(19, (u32) ir19);
-  set_interrupt_handler(20, (u32) ir20);
-  set_interrupt_handler(21, (u32) ir21);
-
-  set_interrupt_handler(32, (u32) timer_interrupt_handler); // the default frequency of the timer interrupts is 18 Hz
+    write_cr4(read_cr4() | CR4_PSE | CR4_PGE);
+    global = PTE_GLOBAL;
+  }
 
-  idtr.base = (u32) &interrupt_descriptor_table;
-  idtr.limit = sizeof(struct InterruptDescriptor) * NUM_INTERRUPT_DESCRIPTORS - 1;
+  u32 kernel_end = round_up((u32) &_bss_end, PAGE_SIZE); // exclusive
+  u32 small_end = round_up(kernel_end, LARGE_PAGE_SIZE);
 
-  enable_interrupts((u32) &idtr);
-}
+  if(small_end > frame_memory_end)
+  {
+    small_end = frame_memory_end;
+  }
 
-__attribute__((naked)) void switch_to_user_mode()
-{
-  // IRET expectes following data on the stack;
-  // 1. stack segment selector ss
-  // 2. stack pointer after IRET
-  // 3. EFLAGS
-  // 4. code segmenent selector cs
-  // 5. instruction pointer EIP
+  // user and kernel pages are mixed at the start of memory, which needs 4 KiB pages
+  for(u32 i = 0; i < small_end; i += PAGE_SIZE)
+  {
+    // the user section is page aligned by the linker script
+    u32 user = (i >= (u32) &_user_start && i < (u32) &_user_end) ? PTE_USER : 0;
 
-  // these registers will be pushed by interrupt handlers, for the first task switch we have to push them ourselves
-  asm volatile("push %0" :: "r"(tasks[active_task_idx].ss));
-  asm volatile("push %0" :: "r"(tasks[active_task_idx].esp));
-  asm volatile("push %0" :: "r"(tasks[active_task_idx].eflags | 0x200));
-  asm volatile("push %0" :: "r"(tasks[active_task_idx].cs));
-  asm volatile("push %0" :: "r"(tasks[active_task_idx].eip));
+    map_page(page_dir, i, i, PTE_WRITEABLE | user | global);
+  }
 
-  // initialize general registers to zero for the first task switch
-  asm volatile("xor %eax, %eax;");
-  asm volatile("xor %ebx, %ebx;");
-  asm volatile("xor %ecx, %ecx;");
-  asm volatile("xor %edx, %edx;");
-  asm volatile("xor %edi, %edi;");
-  asm volatile("xor %esi, %esi;");
-  asm volatile("xor %ebp, %ebp;");
+  map_identity(page_dir, small_end, frame_memory_end, PTE_WRITEABLE | global);
 
-  asm volatile("jmp task_switch;");
+  write_cr3( (u32) &page_dir );
+  enable_paging();
 }
 
-char* base = (char*) (0xb8000);
-int current_row = 0;
-int current_col = 0;
+// every address space shares the kernel part of the page directory, the rest is private to a task
+#define KERNEL_SPACE_END 0x40000000
+#define USER_STACK_TOP   0xc0000000
 
-#define NUM_ROWS 24
-#define NUM_COLS 80
+// user memory is mapped on the first access, the stack grows down from USER_STACK_TOP up to its limit,
+// the heap grows up from USER_HEAP_START to the break a task sets with SYS_BRK
+#define USER_STACK_LIMIT 0x100000   // 1 MiB
+#define USER_HEAP_START  0x80000000
+#define USER_HEAP_LIMIT  0x10000000 // 256 MiB
 
-void put_char(char c) 
+// returns the physical address of a new page directory
+u32 create_address_space()
 {
-  if(c == '\n')
+  u32 dir = frame_alloc();
+
+  if(dir == 0)
   {
-    current_col = 0;
-    ++current_row;
-    if(current_row >= NUM_ROWS)
-    {
-      clear_screen();
-      current_row = 0;
-    }
-    return;
+    print("out of memory\n");
+    halt();
   }
 
-  *(base + (current_row * NUM_COLS + current_col) * 2 + 0) = c;
-  *(base + (current_row * NUM_COLS + current_col) * 2 + 1) = 128;
-
-  ++current_col;
+  zero_page(dir);
 
-  if(current_col >= 80) 
+  // kernel page tables are shared, so later mappings in the kernel part are seen by all tasks
+  for(u32 i = 0; i < KERNEL_SPACE_END / LARGE_PAGE_SIZE; ++i)
   {
-    current_col = 0;
-    ++current_row;
+    ((PageDirectoryEntry*) dir)[i] = page_dir[i];
   }
+
+  return dir;
 }
 
-void print(char const* s) 
+u32 frame_alloc_or_halt()
 {
-  while(*s != 0)
+  u32 frame = frame_alloc();
+
+  if(frame == 0)
   {
-    put_char(*s);
-    ++s;
+    print("out of memory\n");
+    halt();
   }
+
+  return frame;
 }
 
-void clear_screen()
+// copies the user part of an address space, writeable pages become read only copy on write pages of both,
+// so only the page tables are copied, an eager clone copies every page instead
+u32 clone_address_space(u32 cr3, u32 eager)
 {
-  char* ptr = (char*) (0xb8000);
+  PageDirectoryEntry* from = (PageDirectoryEntry*) cr3;
+  PageDirectoryEntry* to = (PageDirectoryEntry*) create_address_space();
 
-  for(int r = 0; r < NUM_ROWS; ++r) 
+  for(u32 i = KERNEL_SPACE_END / LARGE_PAGE_SIZE; i < PD_NUM_ENTRIES; ++i)
   {
-    for (int c = 0; c < NUM_COLS; ++c) 
+    if(!(from[i] & PDE_PRESENT))
+    {
+      continue;
+    }
+
+    PageTableEntry* pt = (PageTableEntry*) (from[i] & 0xfffff000);
+    PageTableEntry* copy = (PageTableEntry*) frame_alloc_or_halt();
+
+    if(eager)
+    {
+      zero_page((u32) copy);
+
+      for(u32 j = 0; j < PT_NUM_ENTRIES; ++j)
+      {
+        if(pt[j] & PTE_PRESENT)
+        {
+          PageTableEntry page = frame_alloc_or_halt();
+
+          copy_u32((void*) page, (void*) (pt[j] & 0xfffff000), PAGE_SIZE / sizeof(u32));
+          copy[j] = page | (pt[j] & 0xfff & ~PTE_COW) | (pt[j] & PTE_COW ? PTE_WRITEABLE : 0);
+        }
+      }
+    }
+    else
     {
-      *ptr++ = 0;
-      *ptr++ = 0;
+      spin_lock(&frame_lock);
+
+      for(u32 j = 0; j < PT_NUM_ENTRIES; ++j)
+      {
+        if(pt[j] & PTE_PRESENT)
+        {
+          if(pt[j] & PTE_WRITEABLE)
+          {
+            pt[j] = (pt[j] & ~PTE_WRITEABLE) | PTE_COW;
+          }
+
+          ++frame_shares[pt[j] / PAGE_SIZE];
+        }
+      }
+
+      spin_unlock(&frame_lock);
+
+      copy_u32(copy, pt, PT_NUM_ENTRIES);
     }
+
+    to[i] = (u32) copy | (from[i] & 0xfff);
   }
+
+  return (u32) to;
 }
 
+// frees the user pages, the page tables and the page directory of an address space that no cpu has loaded
+void free_address_space(u32 cr3)
+{
+  PageDirectoryEntry* dir = (PageDirectoryEntry*) cr3;
+
+  for(u32 i = KERNEL_SPACE_END / LARGE_PAGE_SIZE; i < PD_NUM_ENTRIES; ++i)
+  {
+    if(!(dir[i] & PDE_PRESENT))
+    {
+      continue;
+    }
 
+    PageTableEntry* pt = (PageTableEntry*) (dir[i] & 0xfffff000);
 
+    for(u32 j = 0; j < PT_NUM_ENTRIES; ++j)
+    {
+      if(pt[j] & PTE_PRESENT)
+      {
+        frame_free(pt[j] & 0xfffff000);
+      }
+    }
 
+    frame_free((u32) pt);
+  }
+
+  frame_free(cr3);
+}
+
+#define MMIO_BASE (KERNEL_SPACE_END - LARGE_PAGE_SIZE) // device registers are mapped into the last 4 MiB of the kernel space
+
+u32 mmio_next = MMIO_BASE;
+
+// maps a page of device registers uncached and returns its virtual address
+u32 map_mmio(u32 phys)
+{
+  u32 virt = mmio_next + (phys & (PAGE_SIZE - 1));
+
+  map_page(page_dir, mmio_next, phys, PTE_WRITEABLE | PTE_PCD | PTE_PWT | (paging_large_pages ? PTE_GLOBAL : 0));
+  mmio_next += PAGE_SIZE;
+
+  return virt;
+}
+
+u64 rdmsr(u32 msr)
+{
+  u32 lo = 0;
+  u32 hi = 0;
+  asm volatile ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+  return ((u64) hi << 32) | lo;
+}
+
+void wrmsr(u32 msr, u64 val)
+{
+  asm volatile ("wrmsr" :: "a"((u32) val), "d"((u32) (val >> 32)), "c"(msr));
+}
+
+// acpi tables, only the multiple apic description table (madt) is used
+struct AcpiHeader
+{
+  char signature[4];
+  u32 length;
+  u8  revision;
+  u8  checksum;
+  char oem_id[6];
+  char oem_table_id[8];
+  u32 oem_revision;
+  u32 creator_id;
+  u32 creator_revision;
+} __attribute__((packed));
+
+#define MADT_LOCAL_APIC     0
+#define MADT_IO_APIC        1
+#define MADT_IRQ_OVERRIDE   2
+
+#define NUM_ISA_IRQS 16
+
+u32 acpi_ioapic_addr;
+u32 acpi_ioapic_gsi_base;
+u32 acpi_num_cpus;
+u8  acpi_cpu_apic_ids[MAX_CPUS];
+u32 acpi_irq_gsi[NUM_ISA_IRQS];   // global system interrupt of an isa irq
+u16 acpi_irq_flags[NUM_ISA_IRQS]; // polarity and trigger mode of an isa irq
+
+u32 acpi_checksum(u8* p, u32 length)
+{
+  u8 sum = 0;
+
+  for(u32 i = 0; i < length; ++i)
+  {
+    sum += p[i];
+  }
+
+  return sum == 0;
+}
+
+u32 acpi_match(char const* a, char const* b, u32 length)
+{
+  for(u32 i = 0; i < length; ++i)
+  {
+    if(a[i] != b[i]) return 0;
+  }
+
+  return 1;
+}
+
+// the root system description pointer is in the first KiB of the ebda or in the bios rom, 16 byte aligned
+u8* acpi_find_rsdp()
+{
+  u32 ebda = (u32) *(u16*) 0x40e << 4;
+
+  for(u32 p = ebda; ebda && p < ebda + 1024; p += 16)
+  {
+    if(acpi_match((char*) p, "RSD PTR ", 8) && acpi_checksum((u8*) p, 20)) return (u8*) p;
+  }
+
+  for(u32 p = 0xe0000; p < 0x100000; p += 16)
+  {
+    if(acpi_match((char*) p, "RSD PTR ", 8) && acpi_checksum((u8*) p, 20)) return (u8*) p;
+  }
+
+  return 0;
+}
+
+// has to run before paging is enabled, the tables are not part of the identity map
+u32 init_acpi()
+{
+  for(u32 i = 0; i < NUM_ISA_IRQS; ++i)
+  {
+    acpi_irq_gsi[i] = i;
+    acpi_irq_flags[i] = 0;
+  }
+
+  u8* rsdp = acpi_find_rsdp();
+
+  if(rsdp == 0)
+  {
+    return 0;
+  }
+
+  struct AcpiHeader* rsdt = (struct AcpiHeader*) *(u32*) (rsdp + 16);
+  u32 num_tables = (rsdt->length - sizeof(struct AcpiHeader)) / sizeof(u32);
+  u32* tables = (u32*) (rsdt + 1);
+
+  for(u32 i = 0; i < num_tables; ++i)
+  {
+    struct AcpiHeader* madt = (struct AcpiHeader*) tables[i];
+
+    if(!acpi_match(madt->signature, "APIC", 4))
+    {
+      continue;
+    }
+
+    // local apic address and flags, followed by variable length entries
+    u8* entry = (u8*) (madt + 1) + 8;
+    u8* end = (u8*) madt + madt->length;
+
+    while(entry < end)
+    {
+      if(entry[0] == MADT_LOCAL_APIC && (*(u32*) (entry + 4) & 0x1) && acpi_num_cpus < MAX_CPUS)
+      {
+        acpi_cpu_apic_ids[acpi_num_cpus++] = entry[3]; // enabled processor
+      }
+      else if(entry[0] == MADT_IO_APIC && acpi_ioapic_addr == 0)
+      {
+        acpi_ioapic_addr = *(u32*) (entry + 4);
+        acpi_ioapic_gsi_base = *(u32*) (entry + 8);
+      }
+      else if(entry[0] == MADT_IRQ_OVERRIDE && entry[3] < NUM_ISA_IRQS)
+      {
+        acpi_irq_gsi[entry[3]] = *(u32*) (entry + 4);
+        acpi_irq_flags[entry[3]] = *(u16*) (entry + 8);
+      }
+
+      entry += entry[1];
+    }
+  }
+
+  return acpi_ioapic_addr != 0;
+}
+
+// local apic registers, offsets from the base address
+#define LAPIC_ID             0x20
+#define LAPIC_TPR            0x80
+#define LAPIC_EOI            0xb0
+#define LAPIC_SVR            0xf0
+#define LAPIC_ICR_LOW        0x300
+#define LAPIC_ICR_HIGH       0x310
+#define LAPIC_LVT_TIMER      0x320
+#define LAPIC_LVT_LINT0      0x350
+#define LAPIC_LVT_LINT1      0x360
+#define LAPIC_LVT_ERROR      0x370
+#define LAPIC_TIMER_INITIAL  0x380
+#define LAPIC_TIMER_CURRENT  0x390
+#define LAPIC_TIMER_DIVIDE   0x3e0
+
+#define LAPIC_SVR_ENABLE     ( 1 << 8 )
+#define LAPIC_LVT_MASKED     ( 1 << 16 )
+#define LAPIC_TIMER_PERIODIC ( 1 << 17 )
+#define LAPIC_TIMER_DIV16    0x3
+
+#define IA32_APIC_BASE        0x1b
+#define IA32_APIC_BASE_ENABLE ( 1 << 11 )
+
+#define CPUID_EDX_APIC ( 1 << 9 )
+
+// i/o apic registers, accessed indirectly through the register select and window registers
+#define IOAPIC_REGSEL        0x00
+#define IOAPIC_WINDOW        0x10
+#define IOAPIC_VERSION       0x01
+#define IOAPIC_REDIRECTION   0x10 // two registers per entry
+#define IOAPIC_MASKED        ( 1 << 16 )
+#define IOAPIC_LEVEL         ( 1 << 15 )
+#define IOAPIC_ACTIVE_LOW    ( 1 << 13 )
+
+#define IRQ_BASE        32   // vector of irq 0, for the pic and the i/o apic
+#define SPURIOUS_VECTOR 0xff
+
+#ifndef USE_APIC
+#define USE_APIC 1
+#endif
+
+u32 apic_enabled; // interrupts are delivered through the local and i/o apic instead of the 8259 pics
+u32 lapic_base;
+u32 ioapic_base;
+
+u32 lapic_read(u32 reg)
+{
+  return *(u32 volatile*) (lapic_base + reg);
+}
+
+void lapic_write(u32 reg, u32 val)
+{
+  *(u32 volatile*) (lapic_base + reg) = val;
+}
+
+u32 ioapic_read(u32 reg)
+{
+  *(u32 volatile*) (ioapic_base + IOAPIC_REGSEL) = reg;
+  return *(u32 volatile*) (ioapic_base + IOAPIC_WINDOW);
+}
+
+void ioapic_write(u32 reg, u32 val)
+{
+  *(u32 volatile*) (ioapic_base + IOAPIC_REGSEL) = reg;
+  *(u32 volatile*) (ioapic_base + IOAPIC_WINDOW) = val;
+}
+
+// routes an isa irq to its vector on the local apic of the bootstrap processor
+void ioapic_route(u32 irq, u32 masked)
+{
+  u32 pin = acpi_irq_gsi[irq] - acpi_ioapic_gsi_base;
+  u32 flags = acpi_irq_flags[irq];
+  u32 low = IRQ_BASE + irq;
+
+  if((flags & 0x3) == 0x3) low |= IOAPIC_ACTIVE_LOW;
+  if(((flags >> 2) & 0x3) == 0x3) low |= IOAPIC_LEVEL;
+  if(masked) low |= IOAPIC_MASKED;
+
+  ioapic_write(IOAPIC_REDIRECTION + pin * 2 + 1, (lapic_read(LAPIC_ID) >> 24) << 24);
+  ioapic_write(IOAPIC_REDIRECTION + pin * 2, low);
+}
+
+// signals the end of an interrupt to the interrupt controller
+void irq_eoi(u32 irq)
+{
+  if(apic_enabled)
+  {
+    lapic_write(LAPIC_EOI, 0);
+    return;
+  }
+
+  if(irq >= 8)
+  {
+    outb(0xa0, 0x20); // pic slave
+  }
+
+  outb(0x20, 0x20);
+}
+
+void init_lapic()
+{
+  wrmsr(IA32_APIC_BASE, rdmsr(IA32_APIC_BASE) | IA32_APIC_BASE_ENABLE);
+
+  lapic_write(LAPIC_TPR, 0); // accept all interrupts
+  lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+  lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED); // the pics are not used
+  lapic_write(LAPIC_LVT_ERROR, LAPIC_LVT_MASKED);
+  lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | SPURIOUS_VECTOR);
+}
+
+// switches from the 8259 pics to the local and i/o apic, if the cpu and the acpi tables report them
+void init_apic(u32 acpi_found)
+{
+  u32 eax, ebx, ecx, edx;
+  cpuid(1, &eax, &ebx, &ecx, &edx);
+
+  if(!USE_APIC || !acpi_found || !(edx & CPUID_EDX_APIC))
+  {
+    return;
+  }
+
+  lapic_base = map_mmio(rdmsr(IA32_APIC_BASE) & 0xfffff000);
+  ioapic_base = map_mmio(acpi_ioapic_addr);
+
+  // mask all irqs of both pics, they stay remapped, so spurious pic interrupts do not hit exception vectors
+  outb(0x21, 0xff);
+  outb(0xa1, 0xff);
+
+  init_lapic();
+
+  u32 num_pins = ((ioapic_read(IOAPIC_VERSION) >> 16) & 0xff) + 1;
+
+  for(u32 pin = 0; pin < num_pins; ++pin)
+  {
+    ioapic_write(IOAPIC_REDIRECTION + pin * 2, IOAPIC_MASKED);
+  }
+
+  // irq 0 (pit) stays masked, the local apic timer replaces it, irq 2 is the pic cascade
+  for(u32 irq = 1; irq < NUM_ISA_IRQS; ++irq)
+  {
+    if(irq != 2 && acpi_irq_gsi[irq] - acpi_ioapic_gsi_base < num_pins)
+    {
+      ioapic_route(irq, 0);
+    }
+  }
+
+  apic_enabled = 1;
+}
+
+struct InterruptDescriptor
+{
+  u16 offset0;
+  u16 selector;
+  u16 flags;
+  u16 offset1;
+};
+
+// interrupt descriptor table register
+struct IDTR
+{
+  u16 limit;
+  u32 base;
+} __attribute__((packed));
+
+#define NUM_INTERRUPT_DESCRIPTORS 256
+struct InterruptDescriptor interrupt_descriptor_table[NUM_INTERRUPT_DESCRIPTORS];
+struct IDTR idtr;
+
+// every vector enters through a generated stub, which pushes a zero where the cpu pushes no error code and the vector,
+// so all handlers get the same frame, pusha followed by the vector, the error code and the interrupt frame
+struct TrapFrame
+{
+  u32 edi;
+  u32 esi;
+  u32 ebp;
+  u32 esp; // ignored by popa
+  u32 ebx;
+  u32 edx;
+  u32 ecx;
+  u32 eax;
+
+  u32 vector;
+  u32 error;
+
+  u32 eip;
+  u32 cs;
+  u32 eflags;
+  u32 user_esp; // only from user mode
+  u32 user_ss;
+};
+
+// returns 1 if the cpu has to switch away from the running task
+typedef u32 (*InterruptHandler)(struct TrapFrame* frame);
+
+#define NUM_EXCEPTIONS      32
+#define INTERRUPT_STUB_SIZE 16
+
+InterruptHandler interrupt_handlers[NUM_INTERRUPT_DESCRIPTORS];
+struct CycleStats interrupt_stats[MAX_CPUS][NUM_INTERRUPT_DESCRIPTORS]; // hits and cycles in the handler per vector
+
+// may be called at any time, the next interrupt on the vector calls the new handler
+void register_interrupt_handler(u8 vector, InterruptHandler handler)
+{
+  interrupt_handlers[vector] = handler;
+}
+
+extern u8 interrupt_stubs[];
+
+#define STR_(x) #x
+#define STR(x) STR_(x)
+
+// double fault, invalid tss, segment not present, stack fault, general protection, page fault, alignment check,
+// control protection, vmm communication and security exceptions come with an error code
+asm(
+  ".pushsection .text\n"
+  ".align " STR(INTERRUPT_STUB_SIZE) "\n"
+  "interrupt_stubs:\n"
+  ".set vector, 0\n"
+  ".rept 256\n"
+  "  .align " STR(INTERRUPT_STUB_SIZE) "\n"
+  "  .if vector != 8 && (vector < 10 || vector > 14) && vector != 17 && vector != 21 && vector != 29 && vector != 30\n"
+  "    push $0\n"
+  "  .endif\n"
+  "  push $vector\n"
+  "  jmp interrupt_entry\n"
+  "  .set vector, vector + 1\n"
+  ".endr\n"
+  ".popsection\n"
+);
+
+u32 interrupt_dispatch(struct TrapFrame* frame)
+{
+  u64 t0 = rdtsc();
+  u32 vector = frame->vector;
+  u32 resched = interrupt_handlers[vector](frame);
+
+  stats_add(&interrupt_stats[cpu_current()->id][vector], (u32) (rdtsc() - t0));
+
+  return resched;
+}
+
+__attribute__((naked)) void interrupt_entry()
+{
+  asm volatile("pusha");
+  asm volatile("push %esp");
+  asm volatile("call interrupt_dispatch");
+  asm volatile("add $4, %esp");
+  asm volatile("test %eax, %eax");
+  asm volatile("popa"); // does not change the flags
+  asm volatile("lea 8(%esp), %esp"); // vector and error code, lea does not change the flags either
+  asm volatile("jnz task_switch");
+  asm volatile("iret");
+}
+
+// interrupts on vectors without a driver are acknowledged and otherwise ignored
+u32 unhandled_interrupt(struct TrapFrame* frame)
+{
+  print("unhandled interrupt:");
+  print_u32(frame->vector);
+
+  if(frame->vector >= IRQ_BASE && frame->vector < IRQ_BASE + 16)
+  {
+    irq_eoi(frame->vector - IRQ_BASE);
+  }
+
+  return 0;
+}
+
+// spurious interrupts of the local apic must not be acknowledged
+u32 spurious_interrupt(struct TrapFrame* frame)
+{
+  return 0;
+}
+
+u32 breakpoints;
+
+// breakpoint, a trap, so returning resumes after the int3
+u32 breakpoint(struct TrapFrame* frame)
+{
+  ++breakpoints;
+  return 0;
+}
+
+// bench "vector <n>" lines for every vector that was hit on any cpu
+void print_interrupt_stats()
+{
+  for(u32 vector = 0; vector < NUM_INTERRUPT_DESCRIPTORS; ++vector)
+  {
+    struct CycleStats s;
+    stats_reset(&s);
+
+    for(u32 i = 0; i < num_cpus; ++i)
+    {
+      stats_merge(&s, &interrupt_stats[i][vector]);
+    }
+
+    if(s.count)
+    {
+      print("bench vector ");
+      put_u32(vector);
+      put_stats(&s);
+    }
+  }
+}
+
+// 16550 uart on com1, output is queued in a ring buffer and written by the transmit interrupt,
+// so printing never waits for the line. producers are serialized by the console lock and consumers by serial_lock,
+// producer and consumer only share the ring indices, so neither waits for the other
+#define COM1            0x3f8
+#define COM1_IRQ        4
+#define UART_DATA       0 // divisor low byte while dlab is set
+#define UART_IER        1 // divisor high byte while dlab is set
+#define UART_IIR        2 // fifo control register on write
+#define UART_LCR        3
+#define UART_MCR        4
+#define UART_LSR        5
+#define UART_IER_THRI   0x02 // interrupt when the transmit fifo is empty
+#define UART_FCR_ENABLE 0x07 // enable and clear both fifos
+#define UART_LCR_8N1    0x03
+#define UART_LCR_DLAB   0x80
+#define UART_MCR_OUT2   0x0b // dtr, rts and out2, which connects the interrupt line
+#define UART_MCR_LOOP   0x1e
+#define UART_LSR_THRE   0x20
+#define UART_FIFO_SIZE  16
+#define UART_DIVISOR    1 // 115200 baud
+
+#define SERIAL_TX_SIZE 65536 // power of two, holds everything printed before interrupts are enabled
+
+u8 serial_tx[SERIAL_TX_SIZE];
+u32 volatile serial_tx_head;   // next byte to queue, only written by producers
+u32 volatile serial_tx_tail;   // next byte to send, only written by consumers
+u32 volatile serial_tx_active; // the transmit interrupt is enabled
+u32 serial_tx_dropped;         // bytes lost to a full ring
+u32 serial_ready;
+Spinlock serial_lock;
+
+void serial_kick()
+{
+  if(serial_ready && !__sync_lock_test_and_set(&serial_tx_active, 1))
+  {
+    // enabling the interrupt while the fifo is empty raises it at once
+    outb(COM1 + UART_IER, UART_IER_THRI);
+  }
+}
+
+void serial_put(char c)
+{
+  u32 head = serial_tx_head;
+
+  if(head - serial_tx_tail == SERIAL_TX_SIZE)
+  {
+    ++serial_tx_dropped;
+    return;
+  }
+
+  serial_tx[head & (SERIAL_TX_SIZE - 1)] = c;
+  serial_tx_head = head + 1;
+}
+
+void serial_write(char const* s, u32 length)
+{
+  for(u32 i = 0; i < length; ++i)
+  {
+    if(s[i] == '\n')
+    {
+      serial_put('\r');
+    }
+
+    serial_put(s[i]);
+  }
+
+  serial_kick();
+}
+
+// fills the empty transmit fifo, called with serial_lock held
+void serial_transmit()
+{
+  u32 tail = serial_tx_tail;
+
+  for(u32 i = 0; i < UART_FIFO_SIZE && tail != serial_tx_head; ++i)
+  {
+    outb(COM1 + UART_DATA, serial_tx[tail++ & (SERIAL_TX_SIZE - 1)]);
+  }
+
+  serial_tx_tail = tail;
+
+  if(tail == serial_tx_head)
+  {
+    outb(COM1 + UART_IER, 0);
+    __sync_lock_release(&serial_tx_active);
+    __sync_synchronize();
+
+    // a producer may have queued bytes after the check, but seen the interrupt still enabled
+    if(serial_tx_head != tail)
+    {
+      serial_kick();
+    }
+  }
+}
+
+u32 serial_interrupt(struct TrapFrame* frame)
+{
+  TRACE(cpu_current(), TRACE_IRQ, COM1_IRQ);
+
+  spin_lock(&serial_lock);
+
+  inb(COM1 + UART_IIR);
+
+  if(inb(COM1 + UART_LSR) & UART_LSR_THRE)
+  {
+    serial_transmit();
+  }
+
+  spin_unlock(&serial_lock);
+
+  irq_eoi(COM1_IRQ);
+  return 0;
+}
+
+// writes out the ring by polling, for when interrupts will not come anymore
+void serial_drain()
+{
+  if(!serial_ready)
+  {
+    return;
+  }
+
+  spin_lock(&serial_lock);
+
+  while(serial_tx_tail != serial_tx_head)
+  {
+    while(!(inb(COM1 + UART_LSR) & UART_LSR_THRE))
+    {
+      asm volatile ("pause");
+    }
+
+    serial_transmit();
+  }
+
+  spin_unlock(&serial_lock);
+}
+
+// qemu exits with status (code << 1) | 1 on a write to this port, if it has an isa-debug-exit device there
+#define DEBUG_EXIT_PORT 0xf4
+
+void debug_exit(u32 code)
+{
+  serial_drain();
+  outb(DEBUG_EXIT_PORT, code);
+}
+
+// stops the cpu after a fatal error
+void halt()
+{
+  // the trace keeps the events that led here
+  TRACE(cpu_current(), TRACE_HALT, 0);
+  trace_enabled = 0;
+
+  serial_drain();
+
+#ifdef BENCH
+  debug_exit(1); // an unattended benchmark run fails instead of hanging
+#endif
+
+  while(1);
+}
+
+u32 init_serial()
+{
+  outb(COM1 + UART_IER, 0);
+  outb(COM1 + UART_LCR, UART_LCR_DLAB);
+  outb(COM1 + UART_DATA, UART_DIVISOR & 0xff);
+  outb(COM1 + UART_IER, UART_DIVISOR >> 8);
+  outb(COM1 + UART_LCR, UART_LCR_8N1);
+  outb(COM1 + UART_IIR, UART_FCR_ENABLE);
+
+  // a byte sent in loopback mode comes back, unless there is no uart
+  outb(COM1 + UART_MCR, UART_MCR_LOOP);
+  outb(COM1 + UART_DATA, 0xae);
+
+  if(inb(COM1 + UART_DATA) != 0xae)
+  {
+    return 0;
+  }
+
+  outb(COM1 + UART_MCR, UART_MCR_OUT2);
+
+  serial_ready = 1;
+  serial_kick();
+
+  return 1;
+}
+
+// page fault error code bits
+#define PF_PRESENT ( 1 << 0 ) // protection violation, not a missing page
+#define PF_WRITE   ( 1 << 1 )
+#define PF_USER    ( 1 << 2 )
+
+// page faults in the kernel are bugs, they are printed and stop the cpu
+void page_fault_dump(u32 error, u32 eip, u32 addr)
+{
+  TRACE(cpu_current(), TRACE_FAULT, 14);
+
+  print("ir14: page fault\n");
+
+  print("error code:");
+  print_u32_hex(error);
+
+  print("p:");
+  print_u32_hex((error >> 0) & 0x1);
+  print("w/r:");
+  print_u32_hex((error >> 1) & 0x1);
+  print("u/s:");
+  print_u32_hex((error >> 2) & 0x1);
+  print("rsvd:");
+  print_u32_hex((error >> 3) & 0x1);
+  print("i/d:");
+  print_u32_hex((error >> 4) & 0x1);
+  print("pk:");
+  print_u32_hex((error >> 5) & 0x1);
+  print("ss:");
+  print_u32_hex((error >> 6) & 0x1);
+  print("sgx:");
+  print_u32_hex((error >> 15) & 0x1);
+
+  print("eip:");
+  print_u32_hex(eip);
+  print("cr2:");
+  print_u32_hex(addr);
+
+  halt();
+}
+
+// pusha followed by the interrupt frame, an interrupt from ring 0 ends at eflags
+struct TaskFrame
+{
+  u32 edi;
+  u32 esi;
+  u32 ebp;
+  u32 esp; // ignored by popa
+  u32 ebx;
+  u32 edx;
+  u32 ecx;
+  u32 eax;
+
+  u32 eip;
+  u32 cs;
+  u32 eflags;
+  u32 user_esp;
+  u32 user_ss;
+};
+
+#define NUM_TASKS 10 // started at boot
+#define MAX_TASKS 64 // size of the task pool
+struct Task;
+
+// a blocked task waits for one event, it is only published as the waiter once it has left its cpu,
+// so a waker never queues a task that is still running
+struct Wait
+{
+  struct Task* volatile task; // published waiter, taken by the waker
+  u32 (*ready)(void* object); // checked again after publishing, the event may have happened in between
+  void* object;
+};
+
+struct Task
+{
+  u32 id;
+  u32 cr3;
+  u32 priority;
+  u32 state;
+  u64 wakeup; // tick a sleeping task becomes runnable again
+  u32 woken;  // set by the timer wheel until the task runs again
+
+  u32 kernel_stack;         // one page, interrupts from user mode start at its top
+  struct TaskFrame* frame;  // saved registers on the kernel stack while the task does not run
+  u32 volatile on_cpu;      // set until the cpu that ran the task has left its kernel stack
+
+  u8* fpu_state;                                  // fxsave image from fpu_state_cache
+  struct Cpu* fpu_cpu;                            // cpu the fpu state was last loaded on
+
+  u32 heap_end;   // break, the heap below it is mapped on demand
+  u32 user_pages; // user pages mapped on demand
+
+  struct Wait* wait; // the event a blocked task waits for
+
+  struct Task* next; // next task in the run queue or timer wheel slot
+};
+
+#define TASK_RUNNABLE 0 // running or waiting in a run queue
+#define TASK_SLEEPING 1 // waiting in a timer wheel
+#define TASK_BLOCKED  2 // waiting for an event
+#define TASK_DEAD     3 // exited, released by the next task that runs on its cpu
+
+// kernel stacks and address spaces are allocated when a task starts, so the pool only holds the control blocks
+struct Task tasks[MAX_TASKS];
+struct Task* task_free_list; // unused tasks, linked through next
+Spinlock task_lock;
+
+// returns a zeroed task from the pool or 0 if all are in use
+struct Task* task_alloc()
+{
+  spin_lock(&task_lock);
+
+  struct Task* task = task_free_list;
+
+  if(task)
+  {
+    task_free_list = task->next;
+  }
+
+  spin_unlock(&task_lock);
+
+  if(task)
+  {
+    fill_u32(task, 0, sizeof(struct Task) / sizeof(u32));
+  }
+
+  return task;
+}
+
+void task_free(struct Task* task)
+{
+  spin_lock(&task_lock);
+  task->next = task_free_list;
+  task_free_list = task;
+  spin_unlock(&task_lock);
+}
+
+// the ids of pool tasks are their slot plus one
+u32 task_pool_id(struct Task* task)
+{
+  return task - tasks + 1;
+}
+u32 num_runnable_tasks;
+
+// system calls take the number in eax and up to three arguments in ebx, esi and edi,
+// the result is returned in eax
+#define SYSCALL_VECTOR 0x80
+
+#define SYS_NULL      0
+#define SYS_PRINT     1 // string
+#define SYS_PRINT_HEX 2 // value
+#define SYS_SLEEP     3 // ticks, 0 only yields
+#define SYS_BENCH     4 // benchmark id, argument, only in the benchmark build
+#define SYS_TRACE     5 // 1 starts tracing, 0 stops it
+#define SYS_PROFILE   6 // 1 starts sampling, 0 stops it
+#define SYS_BRK       7 // increment in bytes, returns the old break
+#define SYS_FORK      8 // 1 copies all pages at once, returns the id of the child or 0 in the child
+#define SYS_SPAWN     9 // user function, priority, value passed in eax, returns the id of the task
+#define SYS_EXIT      10
+#define SYS_CHANNEL   11 // returns the id of a new channel
+#define SYS_SEND      12 // channel, message, size up to MESSAGE_SIZE
+#define SYS_SEND_PAGE 13 // channel, page aligned address of a heap or stack page, which moves to the receiver
+#define SYS_RECV      14 // channel, buffer of MESSAGE_SIZE bytes, address a moved page is mapped at, returns the size
+#define SYS_READ      15 // buffer, size, returns the keyboard characters read
+#define NUM_SYSCALLS  16
+
+#define MESSAGE_SIZE  56         // bytes a message copies, larger payloads move whole pages
+#define SYSCALL_AGAIN ((u32) -2) // the task blocked and the call is repeated once it was woken
+
+u32 syscall_fast USER_DATA; // set if the cpus support sysenter
+
+USER u32 syscall_int(u32 n, u32 a0, u32 a1, u32 a2)
+{
+  u32 ret = 0;
+  asm volatile("int %1" : "=a"(ret) : "i"(SYSCALL_VECTOR), "a"(n), "b"(a0), "S"(a1), "D"(a2) : "memory");
+  return ret;
+}
+
+// sysexit returns to the eip in edx with the esp in ecx
+USER u32 syscall_sysenter(u32 n, u32 a0, u32 a1, u32 a2)
+{
+  u32 ret = 0;
+  asm volatile("mov %%esp, %%ecx; mov $1f, %%edx; sysenter; 1:" : "=a"(ret) : "a"(n), "b"(a0), "S"(a1), "D"(a2) : "ecx", "edx", "memory");
+  return ret;
+}
+
+USER u32 syscall(u32 n, u32 a0, u32 a1, u32 a2)
+{
+  return syscall_fast ? syscall_sysenter(n, a0, a1, a2) : syscall_int(n, a0, a1, a2);
+}
+
+USER void sys_print(char const* s)
+{
+  syscall(SYS_PRINT, (u32) s, 0, 0);
+}
+
+USER void sys_print_hex(u32 val)
+{
+  syscall(SYS_PRINT_HEX, val, 0, 0);
+}
+
+// gives up the cpu for at least the given ticks, 0 only yields
+USER void sys_sleep(u32 ticks)
+{
+  syscall(SYS_SLEEP, ticks, 0, 0);
+}
+
+// grows or shrinks the heap, returns the start of the new memory or -1
+USER void* sys_sbrk(i32 increment)
+{
+  return (void*) syscall(SYS_BRK, increment, 0, 0);
+}
+
+// the child shares the memory of the parent copy on write, -1 if there is no free task slot
+USER u32 sys_fork()
+{
+  return syscall(SYS_FORK, 0, 0, 0);
+}
+
+// starts a task with a new address space at a user function, -1 if there is no free task slot
+USER u32 sys_spawn(void (*main)(), u32 priority, u32 arg)
+{
+  return syscall(SYS_SPAWN, (u32) main, priority, arg);
+}
+
+USER void sys_exit()
+{
+  syscall(SYS_EXIT, 0, 0, 0);
+}
+
+// a channel carries messages from one sending task to one receiving task, the first ones to use it, -1 if there are too many
+USER u32 sys_channel()
+{
+  return syscall(SYS_CHANNEL, 0, 0, 0);
+}
+
+// copies up to MESSAGE_SIZE bytes into the channel, waits while it is full, returns 0 or -1
+USER u32 sys_send(u32 channel, void const* message, u32 size)
+{
+  u32 ret;
+
+  while((ret = syscall(SYS_SEND, channel, (u32) message, size)) == SYSCALL_AGAIN);
+
+  return ret;
+}
+
+// moves a page into the channel without copying it, the page reads as zeroed when the sender touches it again
+USER u32 sys_send_page(u32 channel, void* page)
+{
+  u32 ret;
+
+  while((ret = syscall(SYS_SEND_PAGE, channel, (u32) page, 0)) == SYSCALL_AGAIN);
+
+  return ret;
+}
+
+// waits for the next message and copies it into buffer, a moved page is mapped at page, which must not be mapped yet,
+// returns the size of the message, PAGE_SIZE for a page, or -1
+USER u32 sys_recv(u32 channel, void* buffer, void* page)
+{
+  u32 ret;
+
+  while((ret = syscall(SYS_RECV, channel, (u32) buffer, (u32) page)) == SYSCALL_AGAIN);
+
+  return ret;
+}
+
+// waits for keyboard input and returns the characters typed so far, up to size, the first task to read owns the keyboard
+USER u32 sys_read(char* buffer, u32 size)
+{
+  u32 ret;
+
+  while((ret = syscall(SYS_READ, (u32) buffer, size, 0)) == SYSCALL_AGAIN);
+
+  return ret;
+}
+
+// echoes the keyboard, at a high priority so typing shows up right away
+USER void user_keyboard()
+{
+  char line[64];
+
+  while(1)
+  {
+    u32 n = sys_read(line, sizeof(line) - 1);
+
+    if(n != (u32) -1)
+    {
+      line[n] = 0;
+      sys_print(line);
+    }
+  }
+}
+
+USER __attribute__((naked)) void user_mode()
+{
+  u32 id;
+  asm volatile("mov %%eax, %0" : "=r"(id)); // init_task passes the task id in eax
+  while(1)
+  {
+    sys_print_hex(id);
+    sys_sleep(100 * id);
+  }
+}
+
+// the task starts with the frame an interrupt from user mode would have left on its kernel stack,
+// its user stack and heap are mapped by the page fault handler once they are touched
+void init_task(struct Task* task, u32 id, u32 priority, u32 eip)
+{
+  task->id           = id;
+  task->priority     = priority;
+  task->cr3          = create_address_space();
+  task->state        = TASK_RUNNABLE;
+  task->heap_end     = USER_HEAP_START;
+  task->user_pages   = 0;
+  task->kernel_stack = frame_alloc();
+
+  if(task->kernel_stack == 0)
+  {
+    print("out of memory\n");
+    halt();
+  }
+
+  struct TaskFrame* frame = (struct TaskFrame*) (task->kernel_stack + PAGE_SIZE) - 1;
+
+  zero_page(task->kernel_stack);
+  frame->eax      = id;
+  frame->eip      = eip;
+  frame->cs       = 0x1b;
+  frame->eflags   = 0x200;
+  frame->user_esp = USER_STACK_TOP;
+  frame->user_ss  = 0x23;
+
+  task->frame = frame;
+
+  // the fxsave image of the state after fninit, with all sse exceptions masked
+  task->fpu_state = fpu_state_alloc();
+  fill_u32(task->fpu_state, 0, FPU_STATE_SIZE / sizeof(u32));
+  *(u16*) &task->fpu_state[0] = 0x37f;   // fpu control word
+  *(u32*) &task->fpu_state[24] = 0x1f80; // mxcsr
+}
+
+// the pool hands out tasks in slot order, the boot tasks are the first NUM_TASKS slots
+void init_tasks()
+{
+  for(u32 i = MAX_TASKS; i > 0; --i)
+  {
+    task_free(&tasks[i - 1]);
+  }
+
+  // the last one echoes the keyboard
+  for(u32 i = 0; i < NUM_TASKS; ++i)
+  {
+    struct Task* task = task_alloc();
+    u32 keyboard = i == NUM_TASKS - 1;
+
+    init_task(task, task_pool_id(task), keyboard ? 0 : PRIORITY_DEFAULT, keyboard ? (u32) user_keyboard : (u32) user_mode);
+  }
+
+  num_runnable_tasks = NUM_TASKS;
+}
+
+// the running task is not queued again, the caller switches away from it
+void task_exit(struct Task* task)
+{
+  task->state = TASK_DEAD;
+  __sync_fetch_and_sub(&num_runnable_tasks, 1);
+}
+
+void channel_release(struct Task* task);
+void keyboard_release(struct Task* task);
+
+// once no cpu runs on the kernel stack or in the address space of a dead task, both are freed and the task goes back to the pool
+void task_release(struct Task* task)
+{
+  channel_release(task);
+  keyboard_release(task);
+  free_address_space(task->cr3);
+  frame_free(task->kernel_stack);
+  slab_free(task->fpu_state);
+  task_free(task);
+}
+
+// time slice in ticks per priority, short for latency critical tasks, long for batch work
+u32 priority_quantum[NUM_PRIORITIES] = { 2, 4, 6, 8, 10, 20, 40, 80 };
+
+void run_queue_push(struct Cpu* cpu, struct Task* task)
+{
+  struct RunQueue* rq = &cpu->run_queue;
+  u32 p = task->priority;
+
+  spin_lock(&rq->lock);
+
+  task->next = 0;
+
+  if(rq->tail[p])
+  {
+    rq->tail[p]->next = task;
+  }
+  else
+  {
+    rq->head[p] = task;
+  }
+
+  rq->tail[p] = task;
+  rq->bitmap |= 1 << p;
+  ++rq->length;
+
+  spin_unlock(&rq->lock);
+}
+
+// takes the first task of the highest non-empty priority
+struct Task* run_queue_pop(struct Cpu* cpu)
+{
+  struct RunQueue* rq = &cpu->run_queue;
+
+  spin_lock(&rq->lock);
+
+  if(rq->bitmap == 0)
+  {
+    spin_unlock(&rq->lock);
+    return 0;
+  }
+
+  u32 p = 0;
+  asm volatile ("bsf %1, %0" : "=r"(p) : "r"(rq->bitmap));
+
+  struct Task* task = rq->head[p];
+  rq->head[p] = task->next;
+
+  if(rq->head[p] == 0)
+  {
+    rq->tail[p] = 0;
+    rq->bitmap &= ~(1 << p);
+  }
+
+  --rq->length;
+
+  spin_unlock(&rq->lock);
+
+  return task;
+}
+
+// a waiting task with a higher priority than the running one preempts it without waiting for the end of the quantum
+u32 run_queue_preempts(struct Cpu* cpu)
+{
+  return cpu->task && (cpu->run_queue.bitmap & ((1 << cpu->task->priority) - 1));
+}
+
+// takes a waiting task from the cpu with the most waiting tasks, if it has at least min_waiting,
+// the lengths are read without locks, a stale length only makes the steal fail or pick a worse victim
+struct Task* run_queue_steal(struct Cpu* thief, u32 min_waiting)
+{
+  struct Cpu* victim = 0;
+
+  for(u32 i = 0; i < num_cpus; ++i)
+  {
+    struct Cpu* cpu = &cpus[i];
+
+    if(cpu == thief || !cpu->online || cpu->run_queue.length < min_waiting)
+    {
+      continue;
+    }
+
+    if(victim == 0 || cpu->run_queue.length > victim->run_queue.length)
+    {
+      victim = cpu;
+    }
+  }
+
+  return victim ? run_queue_pop(victim) : 0;
+}
+
+// programmable interval timer (pit), channel 0 is connected to irq 0
+#define PIT_FREQUENCY     1193182
+#define PIT_CHANNEL0      0x40
+#define PIT_COMMAND       0x43
+#define PIT_LOHI          0x30 // channel 0, access low byte then high byte
+#define PIT_MODE_ONESHOT  0x00 // mode 0, interrupt on terminal count
+#define PIT_MODE_PERIODIC 0x04 // mode 2, rate generator
+#define PIT_READBACK      0xc2 // latch status and count of channel 0
+#define PIT_STATUS_OUT    0x80 // output pin, raised on terminal count in mode 0
+
+#define TIMER_PERIODIC 0 // interrupt on every tick
+#define TIMER_ONESHOT  1 // tickless, interrupt only on the next deadline or at the end of the quantum
+
+#ifndef TIMER_HZ
+#define TIMER_HZ 1000
+#endif
+
+#ifndef TIMER_MODE
+#define TIMER_MODE TIMER_ONESHOT
+#endif
+
+#define TIMER_IDLE_POLL 10 // ticks an idle cpu waits before it looks for work to steal again
+
+// every cpu has its own timer, the tick count is derived from the time stamp counter all cpus share
+u32 timer_mode;
+u32 timer_divisor;      // pit clock cycles or local apic timer counts per tick
+u32 timer_max_count;    // largest count the timer can be armed with
+u32 timer_tsc_per_tick;
+u64 timer_tsc_base;     // time stamp counter at tick 0
+u32 timer_interrupts;
+
+void pit_program(u8 mode, u16 count)
+{
+  outb(PIT_COMMAND, PIT_LOHI | mode);
+  outb(PIT_CHANNEL0, count & 0xff);
+  outb(PIT_CHANNEL0, count >> 8);
+}
+
+// remaining count of the one-shot pit, 0 once the terminal count was reached
+u32 pit_remaining()
+{
+  outb(PIT_COMMAND, PIT_READBACK);
+  u8 status = inb(PIT_CHANNEL0);
+  u32 count = inb(PIT_CHANNEL0);
+  count |= inb(PIT_CHANNEL0) << 8;
+
+  return (status & PIT_STATUS_OUT) ? 0 : count;
+}
+
+// busy waits for count pit clock cycles
+void pit_wait(u16 count)
+{
+  pit_program(PIT_MODE_ONESHOT, count);
+  while(pit_remaining());
+  outb(PIT_COMMAND, PIT_LOHI | PIT_MODE_ONESHOT); // no count is written, so the counter does not run
+}
+
+// counts the time stamp counter cycles and the local apic timer decrements in 10 ms measured with the pit
+void timer_calibrate(u32* tsc, u32* lapic)
+{
+  if(apic_enabled)
+  {
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIV16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+  }
+
+  pit_program(PIT_MODE_ONESHOT, PIT_FREQUENCY / 100);
+
+  if(apic_enabled)
+  {
+    lapic_write(LAPIC_TIMER_INITIAL, 0xffffffff);
+  }
+
+  u64 t0 = rdtsc();
+  while(pit_remaining());
+  u64 t1 = rdtsc();
+
+  if(apic_enabled)
+  {
+    *lapic = 0xffffffff - lapic_read(LAPIC_TIMER_CURRENT);
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+  }
+
+  *tsc = (u32) (t1 - t0);
+
+  outb(PIT_COMMAND, PIT_LOHI | PIT_MODE_ONESHOT); // no count is written, so the counter does not run
+}
+
+// programs the timer of the calling cpu with the configuration of timer_configure
+void timer_init_cpu()
+{
+  if(apic_enabled)
+  {
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIV16);
+
+    if(timer_mode == TIMER_PERIODIC)
+    {
+      lapic_write(LAPIC_LVT_TIMER, IRQ_BASE | LAPIC_TIMER_PERIODIC);
+      lapic_write(LAPIC_TIMER_INITIAL, timer_divisor);
+    }
+    else
+    {
+      lapic_write(LAPIC_LVT_TIMER, IRQ_BASE);
+    }
+
+    return;
+  }
+
+  if(timer_mode == TIMER_PERIODIC)
+  {
+    pit_program(PIT_MODE_PERIODIC, timer_divisor);
+  }
+  else
+  {
+    outb(PIT_COMMAND, PIT_LOHI | PIT_MODE_ONESHOT);
+  }
+}
+
+void timer_configure(u32 hz, u32 mode)
+{
+  u32 tsc = 0;
+  u32 lapic = 0;
+  timer_calibrate(&tsc, &lapic);
+
+  timer_mode = mode;
+  timer_tsc_per_tick = div_u64((u64) tsc * 100, hz);
+
+  if(apic_enabled)
+  {
+    timer_divisor = div_u64((u64) lapic * 100, hz);
+    timer_max_count = 0xffffffff;
+  }
+  else
+  {
+    timer_divisor = PIT_FREQUENCY / hz;
+    timer_max_count = 0xffff;
+
+    if(timer_divisor > 0xffff)
+    {
+      timer_divisor = 0xffff; // slowest rate, about 18.2 Hz
+    }
+  }
+
+  timer_tsc_base = rdtsc();
+  timer_init_cpu();
+}
+
+void init_timer()
+{
+  timer_configure(TIMER_HZ, TIMER_MODE);
+}
+
+// ticks since init_timer
+u64 timer_now()
+{
+  return div_u64(rdtsc() - timer_tsc_base, timer_tsc_per_tick);
+}
+
+// arms the one-shot timer of the calling cpu, a count of 0 stops it
+void timer_arm(u32 count)
+{
+  if(apic_enabled)
+  {
+    lapic_write(LAPIC_TIMER_INITIAL, count);
+  }
+  else if(count)
+  {
+    pit_program(PIT_MODE_ONESHOT, count);
+  }
+  else
+  {
+    outb(PIT_COMMAND, PIT_LOHI | PIT_MODE_ONESHOT);
+  }
+}
+
+// preemption is only needed if another task could run on the cpu
+u32 timer_need_quantum(struct Cpu* cpu)
+{
+  return cpu->run_queue.length > 0 || num_runnable_tasks > num_cpus || (cpu->task == cpu->idle && num_runnable_tasks > 0);
+}
+
+// rotates the slot bitmap of a wheel level so that bit 0 is the given slot
+u32 timer_wheel_rotate(u32 bitmap, u32 slot)
+{
+  return slot ? (bitmap >> slot) | (bitmap << (TIMER_WHEEL_SLOTS - slot)) : bitmap;
+}
+
+// a task goes to the lowest level that reaches its wakeup, wakeups beyond the top level are clamped and inserted again on expiry
+void timer_wheel_insert(struct Cpu* cpu, struct Task* task)
+{
+  u64 wakeup = task->wakeup < cpu->wheel_next ? cpu->wheel_next : task->wakeup;
+  u64 delta = wakeup - cpu->wheel_next;
+  u32 level = 0;
+
+  while(level < TIMER_WHEEL_LEVELS - 1 && delta >= (1 << (TIMER_WHEEL_BITS * (level + 1))))
+  {
+    ++level;
+  }
+
+  if(delta >= (1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)))
+  {
+    wakeup = cpu->wheel_next + (1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+  }
+
+  u32 slot = (wakeup >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+
+  task->next = cpu->wheel[level][slot];
+  cpu->wheel[level][slot] = task;
+  cpu->wheel_bitmap[level] |= 1 << slot;
+}
+
+u32 timer_wheel_empty(struct Cpu* cpu)
+{
+  for(u32 level = 0; level < TIMER_WHEEL_LEVELS; ++level)
+  {
+    if(cpu->wheel_bitmap[level])
+    {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+// makes a sleeping or blocked task runnable on the given cpu
+void task_wake(struct Cpu* cpu, struct Task* task)
+{
+  TRACE(cpu_current(), TRACE_WAKE, task->id);
+
+  task->state = TASK_RUNNABLE;
+  __sync_fetch_and_add(&num_runnable_tasks, 1);
+  run_queue_push(cpu, task);
+}
+
+// blocks the running task on an event, the system call returns through a task switch
+void task_block(struct Cpu* cpu, struct Task* task, struct Wait* wait)
+{
+  task->state = TASK_BLOCKED;
+  task->wait = wait;
+  __sync_fetch_and_sub(&num_runnable_tasks, 1);
+
+  cpu->resched = 1;
+}
+
+// wakes the waiter of an event onto the run queue of this cpu, if there is one
+void wait_wake(struct Cpu* cpu, struct Wait* wait)
+{
+  struct Task* task = __sync_lock_test_and_set(&wait->task, 0); // a locked exchange orders it after the stores of the event
+
+  if(task)
+  {
+    task_wake(cpu, task);
+  }
+}
+
+// publishes a task that blocked and left its cpu, unless the event happened since
+void wait_publish(struct Cpu* cpu, struct Task* task)
+{
+  struct Wait* wait = task->wait;
+
+  wait->task = task;
+  __sync_synchronize();
+
+  if(wait->ready(wait->object))
+  {
+    wait_wake(cpu, wait);
+  }
+}
+
+// expires the wheel up to the given tick, one slot per tick,
+// a slot of a higher level is moved down when the levels below it wrap around
+void timer_wheel_advance(struct Cpu* cpu, u64 now)
+{
+  while(cpu->wheel_next <= now)
+  {
+    u64 tick = cpu->wheel_next;
+
+    if(timer_wheel_empty(cpu))
+    {
+      cpu->wheel_next = now + 1; // nothing sleeps, skip the empty slots
+      return;
+    }
+
+    for(u32 level = 1; level < TIMER_WHEEL_LEVELS && ((tick >> (TIMER_WHEEL_BITS * (level - 1))) & (TIMER_WHEEL_SLOTS - 1)) == 0; ++level)
+    {
+      u32 slot = (tick >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+      struct Task* task = cpu->wheel[level][slot];
+
+      cpu->wheel[level][slot] = 0;
+      cpu->wheel_bitmap[level] &= ~(1 << slot);
+
+      while(task)
+      {
+        struct Task* next = task->next;
+        timer_wheel_insert(cpu, task);
+        task = next;
+      }
+    }
+
+    u32 slot = tick & (TIMER_WHEEL_SLOTS - 1);
+    struct Task* task = cpu->wheel[0][slot];
+
+    cpu->wheel[0][slot] = 0;
+    cpu->wheel_bitmap[0] &= ~(1 << slot);
+    cpu->wheel_next = tick + 1;
+
+    while(task)
+    {
+      struct Task* next = task->next;
+
+      if(task->wakeup <= tick)
+      {
+        task->woken = 1;
+        task_wake(cpu, task);
+      }
+      else
+      {
+        timer_wheel_insert(cpu, task); // clamped wakeup
+      }
+
+      task = next;
+    }
+  }
+}
+
+// earliest tick the wheel has to be advanced at, 0 if no task sleeps,
+// for higher levels this is the tick at which their next non-empty slot moves down
+u64 timer_wheel_next_expiry(struct Cpu* cpu)
+{
+  u64 tick = cpu->wheel_next;
+  u64 next = 0;
+
+  u32 pending = timer_wheel_rotate(cpu->wheel_bitmap[0], tick & (TIMER_WHEEL_SLOTS - 1));
+
+  if(pending)
+  {
+    u32 distance = 0;
+    asm volatile ("bsf %1, %0" : "=r"(distance) : "r"(pending));
+    next = tick + distance;
+  }
+
+  for(u32 level = 1; level < TIMER_WHEEL_LEVELS; ++level)
+  {
+    if(cpu->wheel_bitmap[level] == 0)
+    {
+      continue;
+    }
+
+    u32 shift = TIMER_WHEEL_BITS * level;
+    u32 slot = (tick >> shift) & (TIMER_WHEEL_SLOTS - 1);
+    u64 base = (tick >> shift) << shift;
+    u64 cascade = base + ((u64) TIMER_WHEEL_SLOTS << shift); // the current slot was moved down already, unless the cascade is due now
+    u32 pending = timer_wheel_rotate(cpu->wheel_bitmap[level], slot);
+
+    if(base == tick && (pending & 1))
+    {
+      cascade = tick;
+    }
+    else if(pending & ~1)
+    {
+      u32 distance = 0;
+      asm volatile ("bsf %1, %0" : "=r"(distance) : "r"(pending & ~1));
+      cascade = base + ((u64) distance << shift);
+    }
+
+    if(next == 0 || cascade < next)
+    {
+      next = cascade;
+    }
+  }
+
+  return next;
+}
+
+// arms the one-shot timer for the earlier of the next wakeup and the end of the quantum,
+// without a sleeping task and with no other task to switch to, no interrupt is armed at all
+void timer_program_next(struct Cpu* cpu)
+{
+  if(timer_mode != TIMER_ONESHOT)
+  {
+    return;
+  }
+
+  u64 next = 0;
+  u64 wakeup = timer_wheel_next_expiry(cpu);
+
+  if(timer_need_quantum(cpu))
+  {
+    next = cpu->quantum_end;
+  }
+
+  if(wakeup && (next == 0 || wakeup < next))
+  {
+    next = wakeup;
+  }
+
+  // the profiler samples on every tick, not only on deadlines
+  if(profile_enabled)
+  {
+    u64 tick = timer_now() + 1;
+
+    if(next == 0 || next > tick)
+    {
+      next = tick;
+    }
+  }
+
+  if(next == cpu->timer_armed)
+  {
+    return; // already armed for this tick
+  }
+
+  if(next == 0)
+  {
+    timer_arm(0);
+    cpu->timer_armed = 0;
+    return;
+  }
+
+  // the count is computed from the time stamp counter, so the interrupt hits the start of the tick
+  u64 now = rdtsc() - timer_tsc_base;
+  u64 at = next * timer_tsc_per_tick;
+  u32 max_ticks = timer_max_count / timer_divisor;
+  u32 count = 1;
+
+  if(at >= now + (u64) max_ticks * timer_tsc_per_tick)
+  {
+    count = max_ticks * timer_divisor; // the interrupt arms the timer again for the rest
+    next = 0;
+  }
+  else if(at > now)
+  {
+    count = div_u64((at - now) * timer_divisor, timer_tsc_per_tick) + 1;
+  }
+
+  timer_arm(count);
+  cpu->timer_armed = next;
+}
+
+// starts the quantum of the task that is about to run
+void timer_start_quantum(struct Cpu* cpu, u32 ticks)
+{
+  cpu->quantum_end = timer_now() + ticks;
+  timer_program_next(cpu);
+}
+
+// the bootloader counts its disk reads and takes the tsc around loading the kernel,
+// the stage 2 stub of a compressed kernel around decompressing it
+#define BOOT_INFO_ADDR 0x900
+
+struct BootInfo
+{
+  u32 disk_reads;
+  u32 sectors;
+  u64 tsc_start;
+  u64 tsc_end;
+  u64 tsc_decompress_start; // 0 without compression
+  u64 tsc_decompress_end;
+  u64 tsc_kernel;           // start was called
+};
+
+// called first in start
+void boot_info_start()
+{
+  ((struct BootInfo*) BOOT_INFO_ADDR)->tsc_kernel = rdtsc();
+}
+
+u32 boot_us(u64 from, u64 to)
+{
+  return div_u64((to - from) * (1000000 / TIMER_HZ), timer_tsc_per_tick);
+}
+
+void print_boot_io()
+{
+  struct BootInfo* info = (struct BootInfo*) BOOT_INFO_ADDR;
+  u32 load = boot_us(info->tsc_start, info->tsc_end);
+  u32 decompress = info->tsc_decompress_end ? boot_us(info->tsc_decompress_start, info->tsc_decompress_end) : 0;
+  u32 total = boot_us(info->tsc_start, info->tsc_kernel);
+
+  print("Kernel loaded with ");
+  put_u32(info->disk_reads);
+  print(" disk reads of ");
+  put_u32(info->sectors);
+  print(" sectors in ");
+  put_u32(load);
+  print(" us, decompressed in ");
+  put_u32(decompress);
+  print(" us, started after ");
+  put_u32(total);
+  print(" us\n");
+
+#ifdef BENCH
+  print_result("boot disk", "reads", info->disk_reads);
+  print_result("boot disk", "sectors", info->sectors);
+  print_result("boot disk", "us", load);
+  print_result("boot decompress", "us", decompress);
+  print_result("boot to start", "us", total);
+#endif
+}
+
+struct TraceBuffer* const trace_buffer = (struct TraceBuffer*) TRACE_ADDR;
+u32 trace_ready;
+
+// tracepoints run with interrupts disabled, so a ring has a single writer
+void trace(struct Cpu* cpu, u32 event, u32 arg)
+{
+  struct TraceRing* ring = &trace_buffer->rings[cpu->id];
+  u32 head = ring->head;
+  struct TraceRecord* record = &ring->records[head & (TRACE_RECORDS - 1)];
+
+  record->tsc   = rdtsc();
+  record->event = event;
+  record->task  = cpu->task ? cpu->task->id : 0; // no task before the cpu entered the scheduler
+  record->arg   = arg;
+
+  ring->head = head + 1;
+}
+
+void init_trace()
+{
+  if(TRACE_ADDR + sizeof(struct TraceBuffer) > frame_memory_end)
+  {
+    print("Not enough memory for the trace buffer!\n");
+    return;
+  }
+
+  trace_buffer->magic        = TRACE_MAGIC;
+  trace_buffer->num_cpus     = num_cpus;
+  trace_buffer->records      = TRACE_RECORDS;
+  trace_buffer->tsc_per_tick = timer_tsc_per_tick;
+  trace_buffer->tick_hz      = TIMER_HZ;
+
+  for(u32 i = 0; i < MAX_CPUS; ++i)
+  {
+    trace_buffer->rings[i].head = 0;
+  }
+
+  trace_ready = 1;
+}
+
+// 1 starts tracing, 0 stops it
+u32 syscall_trace(u32 on, u32 a1, u32 a2)
+{
+  if(!trace_ready)
+  {
+    return -1;
+  }
+
+  trace_enabled = on;
+  return 0;
+}
+
+struct Profile* const profile = (struct Profile*) PROFILE_ADDR;
+u32 profile_ready;
+
+void profile_sample(struct Cpu* cpu, u32 eip)
+{
+  u32 bucket = (eip - profile->image_start) >> PROFILE_BUCKET_SHIFT;
+  u32 id = cpu->task->id;
+
+  __sync_fetch_and_add(&profile->samples, 1);
+
+  if(eip >= profile->image_start && bucket < PROFILE_BUCKETS)
+  {
+    __sync_fetch_and_add(&profile->buckets[bucket], 1);
+  }
+  else
+  {
+    __sync_fetch_and_add(&profile->outside, 1);
+  }
+
+  if(id < PROFILE_TASKS)
+  {
+    __sync_fetch_and_add(&profile->task_samples[id], 1);
+  }
+}
+
+void init_profile()
+{
+  if(PROFILE_ADDR + sizeof(struct Profile) > frame_memory_end)
+  {
+    print("Not enough memory for the profile!\n");
+    return;
+  }
+
+  profile->magic        = PROFILE_MAGIC;
+  profile->image_start  = (u32) &_text_start;
+  profile->bucket_shift = PROFILE_BUCKET_SHIFT;
+  profile->num_buckets  = PROFILE_BUCKETS;
+  profile->samples      = 0;
+  profile->outside      = 0;
+
+  fill_u32(profile->task_samples, 0, PROFILE_TASKS);
+  fill_u32(profile->buckets, 0, PROFILE_BUCKETS);
+
+  profile_ready = 1;
+}
+
+// 1 starts sampling, 0 stops it, the histogram keeps counting across runs
+u32 syscall_profile(u32 on, u32 a1, u32 a2)
+{
+  if(!profile_ready)
+  {
+    return -1;
+  }
+
+  profile_enabled = on;
+  return 0;
+}
+
+// called on every timer interrupt, returns 1 if the quantum of the running task expired,
+// a woken task preempts it or the cpu is idle and there is work to look for
+#ifdef BENCH
+struct CycleStats timer_latency_stats[MAX_CPUS]; // from the deadline the one-shot timer was armed for to the handler
+struct CycleStats timer_handler_stats[MAX_CPUS];
+#endif
+
+u32 timer_interrupt(struct TrapFrame* frame)
+{
+  struct Cpu* cpu = cpu_current();
+
+  TRACE(cpu, TRACE_TIMER, 0);
+
+  if(profile_enabled)
+  {
+    profile_sample(cpu, frame->eip);
+  }
+
+#ifdef BENCH
+  u64 entry = rdtsc();
+
+  if(cpu->timer_armed)
+  {
+    u64 due = timer_tsc_base + cpu->timer_armed * timer_tsc_per_tick;
+
+    stats_add(&timer_latency_stats[cpu->id], entry > due ? (u32) (entry - due) : 0);
+  }
+#endif
+
+  irq_eoi(0);
+
+  __sync_fetch_and_add(&timer_interrupts, 1);
+
+  u64 now = timer_now();
+  cpu->timer_armed = 0;
+
+  timer_wheel_advance(cpu, now);
+
+  u32 preempt = run_queue_preempts(cpu) || (timer_need_quantum(cpu) && now >= cpu->quantum_end);
+
+  if(!preempt)
+  {
+    timer_program_next(cpu); // otherwise task_switch starts the next quantum
+  }
+
+  TRACE(cpu, TRACE_TIMER_END, preempt);
+
+#ifdef BENCH
+  stats_add(&timer_handler_stats[cpu->id], (u32) (rdtsc() - entry));
+#endif
+
+  return preempt;
+}
+
+// puts the running task to sleep, the system call returns through a task switch
+u32 syscall_sleep(u32 ticks, u32 a1, u32 a2)
+{
+  struct Cpu* cpu = cpu_current();
+  struct Task* task = cpu->task;
+
+  cpu->resched = 1;
+
+  if(ticks == 0)
+  {
+    return 0; // yield, the task stays runnable
+  }
+
+  task->state = TASK_SLEEPING;
+  task->wakeup = timer_now() + ticks;
+  __sync_fetch_and_sub(&num_runnable_tasks, 1);
+
+  timer_wheel_insert(cpu, task);
+  return 0;
+}
+
+// fpu and sse state is loaded lazily, cr0.ts makes the first fpu instruction after a switch trap,
+// so tasks that never use the fpu pay nothing
+u32 fpu_supported;
+
+#ifdef BENCH
+struct CycleStats fpu_trap_stats[MAX_CPUS];
+#endif
+
+void fxsave(u8* state)
+{
+  asm volatile ("fxsave (%0)" :: "r"(state) : "memory");
+}
+
+void fxrstor(u8* state)
+{
+  asm volatile ("fxrstor (%0)" :: "r"(state) : "memory");
+}
+
+// called on every cpu
+void init_fpu()
+{
+  u32 eax, ebx, ecx, edx;
+  cpuid(1, &eax, &ebx, &ecx, &edx);
+
+  fpu_supported = (edx & CPUID_EDX_FXSR) && (edx & CPUID_EDX_SSE);
+
+  if(!fpu_supported)
+  {
+    write_cr0(read_cr0() | CR0_EM); // every use traps and stops the kernel
+    return;
+  }
+
+  write_cr4(read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+  write_cr0((read_cr0() & ~CR0_EM) | CR0_MP | CR0_NE | CR0_TS);
+}
+
+// the state of a task that used the fpu is saved when it is switched away from, as it may continue on another cpu,
+// its registers stay loaded, so switching back to it on the same cpu does not trap
+void fpu_switch(struct Cpu* cpu, struct Task* prev, struct Task* next)
+{
+  if(!fpu_supported || prev == next)
+  {
+    return;
+  }
+
+  u32 cr0 = read_cr0();
+
+  if(!(cr0 & CR0_TS))
+  {
+    fxsave(prev->fpu_state); // prev is the fpu owner of this cpu
+  }
+
+  u32 ts = next == cpu->fpu_owner && next->fpu_cpu == cpu ? 0 : CR0_TS;
+
+  if((cr0 & CR0_TS) != ts)
+  {
+    write_cr0((cr0 & ~CR0_TS) | ts);
+  }
+}
+
+// device not available, the first fpu or sse instruction after a task switch
+u32 fpu_trap(struct TrapFrame* frame)
+{
+  if(!fpu_supported)
+  {
+    print("no fpu\n");
+    halt();
+  }
+
+  struct Cpu* cpu = cpu_current();
+  struct Task* task = cpu->task;
+
+  TRACE(cpu, TRACE_FPU_TRAP, 0);
+
+#ifdef BENCH
+  u64 t0 = rdtsc();
+#endif
+
+  // the state of the previous owner was saved when it was switched away from
+  asm volatile ("clts");
+  fxrstor(task->fpu_state);
+
+  cpu->fpu_owner = task;
+  task->fpu_cpu = cpu;
+
+#ifdef BENCH
+  stats_add(&fpu_trap_stats[cpu->id], (u32) (rdtsc() - t0));
+#endif
+
+  return 0;
+}
+
+// the idle task halts the cpu until the next interrupt
+__attribute__((naked)) void cpu_idle()
+{
+  asm volatile("1: sti; hlt; jmp 1b");
+}
+
+struct Task idle_tasks[MAX_CPUS];
+
+#ifdef BENCH
+struct CycleStats switch_stats[MAX_CPUS];
+struct CycleStats wakeup_stats[MAX_CPUS];
+#endif
+
+// the idle task runs in ring 0 on the stack of the cpu and is never queued,
+// enter_scheduler leaves its first frame
+void init_idle_task(struct Cpu* cpu)
+{
+  struct Task* idle = &idle_tasks[cpu->id];
+
+  idle->priority     = NUM_PRIORITIES; // below every queued task, so any waiting task preempts it
+  idle->state        = TASK_RUNNABLE;
+  idle->kernel_stack = (u32) cpu->stack;
+  idle->on_cpu       = 1;
+  idle->fpu_state    = fpu_state_alloc();
+
+  cpu->idle = idle;
+  cpu->task = idle;
+  cpu->wheel_next = timer_now();
+
+#ifdef BENCH
+  stats_reset(&switch_stats[cpu->id]); // a zeroed min would never be lowered
+  stats_reset(&fpu_trap_stats[cpu->id]);
+  stats_reset(&wakeup_stats[cpu->id]);
+  stats_reset(&timer_latency_stats[cpu->id]);
+  stats_reset(&timer_handler_stats[cpu->id]);
+#endif
+}
+
+// saves the frame of the interrupted task and returns the frame of the next one,
+// a cpu without waiting tasks steals one from the busiest cpu
+struct TaskFrame* schedule(struct TaskFrame* frame)
+{
+  struct Cpu* cpu = cpu_current();
+  struct Task* prev = cpu->task;
+  u32 requeued = prev != cpu->idle && prev->state == TASK_RUNNABLE;
+
+#ifdef BENCH
+  cpu->switch_start = rdtsc();
+#endif
+
+  prev->frame = frame;
+
+  if(requeued)
+  {
+    run_queue_push(cpu, prev);
+  }
+
+  struct Task* next = 0;
+
+  if(cpu->run_queue.length <= requeued)
+  {
+    next = run_queue_steal(cpu, requeued + 1); // leave the victim at least one waiting task if prev can run here
+  }
+
+  if(next == 0)
+  {
+    next = run_queue_pop(cpu);
+  }
+
+  if(next == 0)
+  {
+    next = cpu->idle;
+  }
+
+  // a task that was just queued by another cpu may still be on its kernel stack there
+  while(next != prev && next->on_cpu)
+  {
+    asm volatile("pause");
+  }
+
+  next->on_cpu = 1;
+  cpu->prev = prev;
+  cpu->task = next;
+
+  // kernel pages are global, so only the private part of the tlb is flushed,
+  // the idle task runs in the kernel address space, so a cpu has only the address space of its running task loaded
+  // and no stale tlb entries of a task that changed its mappings or exited elsewhere
+  u32 cr3 = next == cpu->idle ? (u32) &page_dir : next->cr3;
+
+  if(cr3 != read_cr3())
+  {
+    write_cr3(cr3);
+  }
+
+  if(next != cpu->idle)
+  {
+    *(struct Cpu**) next->kernel_stack = cpu;
+    cpu->tss.esp0 = next->kernel_stack + PAGE_SIZE;
+  }
+
+  TRACE(cpu, TRACE_SWITCH, next->id);
+
+  fpu_switch(cpu, prev, next);
+  timer_start_quantum(cpu, next == cpu->idle ? TIMER_IDLE_POLL : priority_quantum[next->priority]);
+
+  return next->frame;
+}
+
+// runs on the kernel stack of the next task, prev may run on another cpu from now on
+void schedule_tail()
+{
+  struct Cpu* cpu = cpu_current();
+
+  if(cpu->prev != cpu->task)
+  {
+    cpu->prev->on_cpu = 0;
+
+    if(cpu->prev->state == TASK_DEAD)
+    {
+      task_release(cpu->prev);
+    }
+    else if(cpu->prev->state == TASK_BLOCKED)
+    {
+      wait_publish(cpu, cpu->prev);
+    }
+  }
+
+#ifdef BENCH
+  u64 now = rdtsc();
+  struct Task* task = cpu->task;
+
+  stats_add(&switch_stats[cpu->id], (u32) (now - cpu->switch_start));
+
+  // how late a woken task runs after the start of its wakeup tick
+  if(task->woken)
+  {
+    u64 due = timer_tsc_base + task->wakeup * timer_tsc_per_tick;
+
+    stats_add(&wakeup_stats[cpu->id], now > due ? (u32) (now - due) : 0);
+    task->woken = 0;
+  }
+#endif
+}
+
+__attribute__((naked)) void task_switch()
+{
+  asm volatile("pusha");
+  asm volatile("push %esp"); // the frame of the interrupted task
+  asm volatile("call schedule");
+  asm volatile("mov %eax, %esp"); // the frame of the next task, on its kernel stack
+  asm volatile("call schedule_tail");
+  asm volatile("popa");
+  asm volatile("iret");
+}
+
+u32 syscall_null(u32 a0, u32 a1, u32 a2)
+{
+  return 0;
+}
+
+// the page table entry of a virtual address in the loaded address space, 0 if it is not mapped
+u32 lookup_page(u32 virt)
+{
+  PageDirectoryEntry pde = ((PageDirectoryEntry*) read_cr3())[virt >> 22];
+
+  if(!(pde & PDE_PRESENT))
+  {
+    return 0;
+  }
+
+  if(pde & PDE_PS)
+  {
+    return pde; // the flags of a 4 MiB page are at the same bits
+  }
+
+  return ((PageTableEntry*) (pde & 0xfffff000))[(virt >> 12) & 0x3ff] & (pde | ~PDE_USER);
+}
+
+// the stack below USER_STACK_TOP and the heap below the break, the rest of the user space is never mapped
+u32 task_region_contains(struct Task* task, u32 addr)
+{
+  return (addr >= USER_STACK_TOP - USER_STACK_LIMIT && addr < USER_STACK_TOP) || (addr >= USER_HEAP_START && addr < task->heap_end);
+}
+
+// maps a zeroed frame at a not present address in a region of the running task, returns 0 if it may not
+u32 task_map_demand(struct Task* task, u32 addr)
+{
+  if(!task_region_contains(task, addr))
+  {
+    return 0;
+  }
+
+  u32 frame = frame_alloc();
+
+  if(frame == 0)
+  {
+    return 0;
+  }
+
+  zero_page(frame);
+  map_page((PageDirectoryEntry*) task->cr3, round_down(addr, PAGE_SIZE), frame, PTE_WRITEABLE | PTE_USER);
+  ++task->user_pages;
+
+  return 1;
+}
+
+// a write to a copy on write page copies the frame, the last address space that maps it takes it over without a copy
+u32 task_copy_on_write(struct Task* task, u32 addr)
+{
+  PageDirectoryEntry* dir = (PageDirectoryEntry*) task->cr3;
+  u32 page = round_down(addr, PAGE_SIZE);
+  PageTableEntry pte = ((PageTableEntry*) (dir[page >> 22] & 0xfffff000))[(page >> 12) & 0x3ff];
+  u32 shared = pte & 0xfffff000;
+
+  if(!(pte & PTE_COW))
+  {
+    return 0;
+  }
+
+  // only this address space maps the frame, no other one can share it again
+  u32 frame = shared;
+
+  if(frame_shares[shared / PAGE_SIZE])
+  {
+    frame = frame_alloc();
+
+    if(frame == 0)
+    {
+      return 0;
+    }
+
+    copy_u32((void*) frame, (void*) shared, PAGE_SIZE / sizeof(u32));
+
+    // the others may have dropped the frame during the copy
+    spin_lock(&frame_lock);
+    u32 still_shared = frame_shares[shared / PAGE_SIZE] != 0;
+
+    if(still_shared)
+    {
+      --frame_shares[shared / PAGE_SIZE];
+    }
+
+    spin_unlock(&frame_lock);
+
+    if(!still_shared)
+    {
+      frame_free(frame);
+      frame = shared;
+    }
+  }
+
+  map_page(dir, page, frame, PTE_WRITEABLE | PTE_USER);
+  asm volatile ("invlpg (%0)" :: "r"(page) : "memory");
+
+  return 1;
+}
+
+// the child continues from the same system call with the same registers and returns 0 there,
+// its address space is cloned copy on write, or copied at once if eager is set, returns -1 if the pool is empty
+u32 syscall_fork(u32 eager, u32 a1, u32 a2)
+{
+  struct Cpu* cpu = cpu_current();
+  struct Task* parent = cpu->task;
+  struct Task* child = task_alloc();
+
+  if(child == 0)
+  {
+    return -1;
+  }
+
+  child->id           = task_pool_id(child);
+  child->priority     = parent->priority;
+  child->cr3          = clone_address_space(parent->cr3, eager);
+  child->state        = TASK_RUNNABLE;
+  child->heap_end     = parent->heap_end;
+  child->user_pages   = parent->user_pages;
+  child->kernel_stack = frame_alloc_or_halt();
+
+  struct TaskFrame* frame = (struct TaskFrame*) (child->kernel_stack + PAGE_SIZE) - 1;
+
+  zero_page(child->kernel_stack);
+  *frame = *cpu->syscall_frame;
+  frame->eax = 0;
+
+  child->frame = frame;
+
+  // the fpu registers of the parent are only saved when it is switched away from
+  if(fpu_supported && !(read_cr0() & CR0_TS))
+  {
+    fxsave(parent->fpu_state);
+  }
+
+  child->fpu_state = fpu_state_alloc();
+  copy_u32(child->fpu_state, parent->fpu_state, FPU_STATE_SIZE / sizeof(u32));
+
+  // the parent lost write access to its pages
+  if(!eager)
+  {
+    write_cr3(parent->cr3);
+  }
+
+  __sync_fetch_and_add(&num_runnable_tasks, 1);
+  run_queue_push(cpu, child);
+
+  return child->id;
+}
+
+// a fault from user mode at a not present address inside a region of the task maps a zeroed frame and retries the access,
+// a write to a copy on write page copies it, any other fault from user mode kills the task, returns 1 if the cpu has to switch away from it
+u32 page_fault(struct TrapFrame* frame)
+{
+  u32 addr = read_cr2();
+  u32 error = frame->error;
+  struct Cpu* cpu = cpu_current();
+
+  if(!(frame->cs & 3))
+  {
+    page_fault_dump(error, frame->eip, addr);
+  }
+
+  TRACE(cpu, TRACE_PAGE_FAULT, addr);
+
+  if(!(error & PF_PRESENT) && task_map_demand(cpu->task, addr))
+  {
+    return 0;
+  }
+
+  if((error & PF_PRESENT) && (error & PF_WRITE) && task_copy_on_write(cpu->task, addr))
+  {
+    return 0;
+  }
+
+  print("task ");
+  put_u32(cpu->task->id);
+  print(" killed, page fault at:");
+  print_u32_hex(addr);
+  print("eip:");
+  print_u32_hex(frame->eip);
+
+  task_exit(cpu->task);
+
+  return 1;
+}
+
+// an exception from user mode kills the task, one in the kernel is a bug and stops the cpu,
+// nmi, double fault and machine check always stop it
+#define USER_EXCEPTIONS ( 1 << 0 | 1 << 4 | 1 << 5 | 1 << 6 | 1 << 12 | 1 << 13 | 1 << 16 | 1 << 17 | 1 << 19 )
+
+char const* exception_names[] =
+{
+  "divide error", "debug", "nmi", "breakpoint", "overflow", "bound range exceeded", "invalid opcode", "device not available",
+  "double fault", "coprocessor segment overrun", "invalid tss", "segment not present", "stack segment fault",
+  "general protection fault", "page fault", "reserved", "x87 floating point error", "alignment check", "machine check",
+  "simd floating point error", "virtualization exception", "control protection exception",
+};
+
+u32 exception_handler(struct TrapFrame* frame)
+{
+  struct Cpu* cpu = cpu_current();
+  u32 vector = frame->vector;
+
+  TRACE(cpu, TRACE_FAULT, vector);
+
+  print("ir");
+  put_u32(vector);
+  print(": ");
+  print(vector < sizeof(exception_names) / sizeof(exception_names[0]) ? exception_names[vector] : "reserved");
+  print("\n");
+
+  print("error code:");
+  print_u32_hex(frame->error);
+
+  // the error code of a general protection fault names the offending segment selector, if any
+  if(vector == 13)
+  {
+    print("ext:");
+    print_u32((frame->error >> 0) & 0x1);
+    print("idt:");
+    print_u32((frame->error >> 1) & 0x1);
+    print("ti:");
+    print_u32((frame->error >> 2) & 0x1);
+    print("segment selector index:");
+    print_u32(frame->error >> 3);
+  }
+
+  print("eip:");
+  print_u32_hex(frame->eip);
+
+  if((frame->cs & 3) && (USER_EXCEPTIONS & (1 << vector)))
+  {
+    print("task ");
+    put_u32(cpu->task->id);
+    print(" killed\n");
+
+    task_exit(cpu->task);
+    return 1;
+  }
+
+  halt();
+  return 0;
+}
+
+// user mode may only pass pointers to its own pages
+u32 user_accessible(u32 virt, u32 size)
+{
+  if(virt + size < virt)
+  {
+    return 0;
+  }
+
+  for(u32 page = round_down(virt, PAGE_SIZE); page < virt + size; page += PAGE_SIZE)
+  {
+    u32 pte = lookup_page(page);
+
+    // not touched yet, mapped like a fault from user mode would be
+    if(!(pte & PTE_PRESENT) && task_map_demand(cpu_current()->task, page))
+    {
+      continue;
+    }
+
+    if((pte & (PTE_PRESENT | PTE_USER)) != (PTE_PRESENT | PTE_USER))
+    {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+// moves the break by increment bytes and returns the old one, the heap is mapped when it is touched,
+// pages entirely above a lowered break are freed
+u32 syscall_brk(u32 increment, u32 a1, u32 a2)
+{
+  struct Task* task = cpu_current()->task;
+  u32 old = task->heap_end;
+  u32 end = old + increment;
+
+  if((i32) increment >= 0 ? end < old || end > USER_HEAP_START + USER_HEAP_LIMIT : end > old || end < USER_HEAP_START)
+  {
+    return -1;
+  }
+
+  for(u32 page = round_up(end, PAGE_SIZE); page < old; page += PAGE_SIZE)
+  {
+    u32 phys = unmap_page((PageDirectoryEntry*) task->cr3, page);
+
+    if(phys)
+    {
+      frame_free(phys);
+      --task->user_pages;
+    }
+  }
+
+  task->heap_end = end;
+
+  return old;
+}
+
+u32 syscall_print(u32 s, u32 a1, u32 a2)
+{
+  for(char const* c = (char const*) s; ; ++c)
+  {
+    if((c == (char const*) s || (u32) c % PAGE_SIZE == 0) && !user_accessible((u32) c, 1))
+    {
+      return -1;
+    }
+
+    if(*c == 0)
+    {
+      console_write((char const*) s, c - (char const*) s);
+      return 0;
+    }
+  }
+}
+
+u32 syscall_print_hex(u32 val, u32 a1, u32 a2)
+{
+  print_u32_hex(val);
+  return 0;
+}
+
+// the entry has to be user code, which every address space maps, not a page of the caller
+u32 syscall_spawn(u32 eip, u32 priority, u32 arg)
+{
+  if(priority >= NUM_PRIORITIES || eip < (u32) &_user_start || eip >= (u32) &_user_end)
+  {
+    return -1;
+  }
+
+  struct Task* task = task_alloc();
+
+  if(task == 0)
+  {
+    return -1;
+  }
+
+  init_task(task, task_pool_id(task), priority, eip);
+  task->frame->eax = arg;
+
+  __sync_fetch_and_add(&num_runnable_tasks, 1);
+  run_queue_push(cpu_current(), task);
+
+  return task->id;
+}
+
+u32 syscall_exit(u32 a0, u32 a1, u32 a2)
+{
+  struct Cpu* cpu = cpu_current();
+
+  task_exit(cpu->task);
+  cpu->resched = 1;
+
+  return 0;
+}
+
+// like user_accessible, and copies copy on write pages first, as cr0.wp keeps the kernel from storing to read only pages
+u32 user_writeable(u32 virt, u32 size)
+{
+  if(!user_accessible(virt, size))
+  {
+    return 0;
+  }
+
+  for(u32 page = round_down(virt, PAGE_SIZE); page < virt + size; page += PAGE_SIZE)
+  {
+    if(!(lookup_page(page) & PTE_WRITEABLE) && !task_copy_on_write(cpu_current()->task, page))
+    {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+// a channel is a ring of message slots, only the sender writes head and only the receiver writes tail,
+// so neither takes a lock, each side keeps the last index it read from the other on its own cache line
+#define CHANNEL_SLOTS 16 // power of two
+#define MAX_CHANNELS  64
+
+struct Message
+{
+  u32 size;               // bytes in data, PAGE_SIZE for a moved page
+  u32 frame;              // moved page, 0 if the message was copied
+  u8 data[MESSAGE_SIZE];
+};
+
+struct Channel
+{
+  u32 volatile head __attribute__((aligned(CACHE_LINE))); // next slot the sender fills
+  u32 tail_seen;
+  struct Task* sender;
+  struct Wait writable;                                   // the sender waits for a free slot
+
+  u32 volatile tail __attribute__((aligned(CACHE_LINE))); // next slot the receiver reads
+  u32 head_seen;
+  struct Task* receiver;
+  struct Wait readable;                                   // the receiver waits for a message
+
+  struct Message slots[CHANNEL_SLOTS] __attribute__((aligned(CACHE_LINE)));
+};
+
+struct Channel* channels[MAX_CHANNELS];
+Spinlock channel_lock;
+
+u32 channel_readable(void* object)
+{
+  struct Channel* channel = object;
+  return channel->head != channel->tail;
+}
+
+u32 channel_writable(void* object)
+{
+  struct Channel* channel = object;
+  return channel->head - channel->tail != CHANNEL_SLOTS;
+}
+
+u32 syscall_channel(u32 a0, u32 a1, u32 a2)
+{
+  struct Channel* channel = kmalloc(sizeof(struct Channel));
+
+  if(channel == 0)
+  {
+    return -1;
+  }
+
+  fill_u32(channel, 0, sizeof(struct Channel) / sizeof(u32));
+  channel->writable.ready  = channel_writable;
+  channel->writable.object = channel;
+  channel->readable.ready  = channel_readable;
+  channel->readable.object = channel;
+
+  spin_lock(&channel_lock);
+
+  for(u32 id = 0; id < MAX_CHANNELS; ++id)
+  {
+    if(channels[id] == 0)
+    {
+      channels[id] = channel;
+      spin_unlock(&channel_lock);
+
+      return id;
+    }
+  }
+
+  spin_unlock(&channel_lock);
+  kfree(channel);
+
+  return -1;
+}
+
+// the channel if the running task may use the given end of it, the first task to use an end owns it
+// the owner of an end finds it without the lock, a channel is only freed once neither end has an owner,
+// claiming an end takes the lock, so the channel can not be freed meanwhile
+struct Channel* channel_get(u32 id, u32 send)
+{
+  if(id >= MAX_CHANNELS)
+  {
+    return 0;
+  }
+
+  struct Task* task = cpu_current()->task;
+  struct Channel* channel = channels[id];
+
+  if(channel && (send ? channel->sender : channel->receiver) == task)
+  {
+    return channel;
+  }
+
+  spin_lock(&channel_lock);
+
+  channel = channels[id];
+
+  if(channel)
+  {
+    struct Task** owner = send ? &channel->sender : &channel->receiver;
+
+    if(*owner == 0)
+    {
+      *owner = task;
+    }
+    else
+    {
+      channel = 0;
+    }
+  }
+
+  spin_unlock(&channel_lock);
+
+  return channel;
+}
+
+// drops the messages nobody will receive and frees their pages, the channel lock is held and no task receives
+void channel_drain(struct Channel* channel)
+{
+  u32 head = channel->head;
+
+  for(u32 tail = channel->tail; tail != head; ++tail)
+  {
+    struct Message* slot = &channel->slots[tail & (CHANNEL_SLOTS - 1)];
+
+    if(slot->frame)
+    {
+      frame_free(slot->frame);
+    }
+  }
+
+  channel->head_seen = head;
+  channel->tail = head;
+}
+
+// frees the ends of an exited task for other tasks, the messages of a dead receiver go with it
+// and a channel goes with its last owner
+void channel_release(struct Task* task)
+{
+  struct Cpu* cpu = cpu_current();
+
+  spin_lock(&channel_lock);
+
+  for(u32 id = 0; id < MAX_CHANNELS; ++id)
+  {
+    struct Channel* channel = channels[id];
+
+    if(channel == 0 || (channel->sender != task && channel->receiver != task))
+    {
+      continue;
+    }
+
+    if(channel->receiver == task)
+    {
+      channel_drain(channel);
+      channel->receiver = 0;
+      wait_wake(cpu, &channel->writable); // a sender waiting for a free slot has room now
+    }
+
+    if(channel->sender == task)
+    {
+      channel->sender = 0;
+    }
+
+    if(channel->sender == 0 && channel->receiver == 0)
+    {
+      channel_drain(channel);
+      channels[id] = 0;
+      kfree(channel);
+    }
+  }
+
+  spin_unlock(&channel_lock);
+}
+
+// the slot the sender fills next, 0 if the channel is full and the sender blocked
+struct Message* channel_reserve(struct Cpu* cpu, struct Channel* channel)
+{
+  u32 head = channel->head;
+
+  if(head - channel->tail_seen == CHANNEL_SLOTS)
+  {
+    channel->tail_seen = channel->tail;
+
+    if(head - channel->tail_seen == CHANNEL_SLOTS)
+    {
+      task_block(cpu, cpu->task, &channel->writable);
+      return 0;
+    }
+  }
+
+  return &channel->slots[head & (CHANNEL_SLOTS - 1)];
+}
+
+// hands the reserved slot to the receiver
+void channel_push(struct Cpu* cpu, struct Channel* channel)
+{
+  asm volatile("" ::: "memory"); // the slot is filled before head passes it, x86 keeps stores in order
+  channel->head = channel->head + 1;
+
+  wait_wake(cpu, &channel->readable);
+}
+
+u32 syscall_send(u32 id, u32 message, u32 size)
+{
+  struct Cpu* cpu = cpu_current();
+  struct Channel* channel = channel_get(id, 1);
+
+  if(channel == 0 || size > MESSAGE_SIZE || !user_accessible(message, size))
+  {
+    return -1;
+  }
+
+  struct Message* slot = channel_reserve(cpu, channel);
+
+  if(slot == 0)
+  {
+    return SYSCALL_AGAIN;
+  }
+
+  slot->size  = size;
+  slot->frame = 0;
+
+  for(u32 i = 0; i < size; ++i)
+  {
+    slot->data[i] = ((u8*) message)[i];
+  }
+
+  channel_push(cpu, channel);
+
+  return 0;
+}
+
+// the page leaves the address space of the sender, only a private writeable page may move,
+// a copy on write page is copied first
+u32 syscall_send_page(u32 id, u32 page, u32 a2)
+{
+  struct Cpu* cpu = cpu_current();
+  struct Task* task = cpu->task;
+  struct Channel* channel = channel_get(id, 1);
+
+  if(channel == 0 || page % PAGE_SIZE || !task_region_contains(task, page) || !user_writeable(page, PAGE_SIZE))
+  {
+    return -1;
+  }
+
+  struct Message* slot = channel_reserve(cpu, channel);
+
+  if(slot == 0)
+  {
+    return SYSCALL_AGAIN;
+  }
+
+  slot->size  = PAGE_SIZE;
+  slot->frame = unmap_page((PageDirectoryEntry*) task->cr3, page);
+  --task->user_pages;
+
+  channel_push(cpu, channel);
+
+  return 0;
+}
+
+// a moved page is mapped at page, which has to be a not present page of the heap or stack,
+// the message stays in the channel if it can not be taken
+u32 syscall_recv(u32 id, u32 buffer, u32 page)
+{
+  struct Cpu* cpu = cpu_current();
+  struct Task* task = cpu->task;
+  struct Channel* channel = channel_get(id, 0);
+
+  if(channel == 0)
+  {
+    return -1;
+  }
+
+  u32 tail = channel->tail;
+
+  if(tail == channel->head_seen)
+  {
+    channel->head_seen = channel->head;
+
+    if(tail == channel->head_seen)
+    {
+      task_block(cpu, task, &channel->readable);
+      return SYSCALL_AGAIN;
+    }
+  }
+
+  asm volatile("" ::: "memory"); // the slot is read after head passed it, x86 keeps loads in order
+
+  struct Message* slot = &channel->slots[tail & (CHANNEL_SLOTS - 1)];
+  u32 size = slot->size;
+
+  if(slot->frame)
+  {
+    if(page % PAGE_SIZE || !task_region_contains(task, page) || (lookup_page(page) & PTE_PRESENT))
+    {
+      return -1;
+    }
+
+    map_page((PageDirectoryEntry*) task->cr3, page, slot->frame, PTE_WRITEABLE | PTE_USER);
+    ++task->user_pages;
+  }
+  else
+  {
+    if(!user_writeable(buffer, size))
+    {
+      return -1;
+    }
+
+    for(u32 i = 0; i < size; ++i)
+    {
+      ((u8*) buffer)[i] = slot->data[i];
+    }
+  }
+
+  asm volatile("" ::: "memory"); // the slot is read before tail frees it
+  channel->tail = tail + 1;
+
+  wait_wake(cpu, &channel->writable);
+
+  return size;
+}
+
+// ps/2 keyboard on the 8042 controller, the interrupt translates scan codes of set 1 and queues the characters in a ring,
+// it is the only writer of head and the reading task the only writer of tail, so neither takes a lock
+#define KEYBOARD_IRQ         1
+#define PS2_DATA             0x60
+#define PS2_STATUS           0x64
+#define PS2_STATUS_OUTPUT    0x01 // a byte waits in the data port
+#define PS2_STATUS_AUX       0x20 // the byte comes from the mouse
+#define SCAN_RELEASE         0x80
+#define SCAN_EXTENDED        0xe0 // prefix of the keys the original keyboard did not have
+#define SCAN_LEFT_SHIFT      0x2a
+#define SCAN_RIGHT_SHIFT     0x36
+#define SCAN_CAPS_LOCK       0x3a
+#define SCAN_PAGE_UP         0x49 // extended
+#define SCAN_PAGE_DOWN       0x51 // extended
+#define KEYBOARD_RING_SIZE   256  // power of two
+#define KEYBOARD_SCROLL_ROWS 12   // half a screen per page up or down
+
+// characters of the scan codes up to the space bar, 0 for keys without one
+char const scan_chars[] =
+  "\0\x1b" "1234567890-=\b"
+  "\tqwertyuiop[]\n"
+  "\0" "asdfghjkl;'`"
+  "\0\\zxcvbnm,./\0"
+  "*\0 ";
+
+char const scan_chars_shift[] =
+  "\0\x1b" "!@#$%^&*()_+\b"
+  "\tQWERTYUIOP{}\n"
+  "\0" "ASDFGHJKL:\"~"
+  "\0|ZXCVBNM<>?\0"
+  "*\0 ";
+
+char keyboard_ring[KEYBOARD_RING_SIZE];
+u32 volatile keyboard_head; // next character the interrupt queues
+u32 volatile keyboard_tail; // next character the reader takes
+u32 keyboard_dropped;       // characters lost to a full ring
+u32 keyboard_shift;         // shift keys held, a bit for each
+u32 keyboard_caps_lock;
+u32 keyboard_extended;      // the last byte was SCAN_EXTENDED
+struct Task* keyboard_reader;
+
+u32 keyboard_readable(void* object)
+{
+  return keyboard_head != keyboard_tail;
+}
+
+struct Wait keyboard_wait = { 0, keyboard_readable, 0 };
+
+// keeps the modifiers and returns the character of a key press, 0 if there is none
+char keyboard_translate(u8 code)
+{
+  u32 extended = keyboard_extended;
+  u32 released = code & SCAN_RELEASE;
+  u8 key = code & ~SCAN_RELEASE;
+
+  keyboard_extended = code == SCAN_EXTENDED;
+
+  if(keyboard_extended)
+  {
+    return 0;
+  }
+
+  // extended keys include fake shifts around some of them, only page up and down are used
+  if(extended)
+  {
+    if(!released && (key == SCAN_PAGE_UP || key == SCAN_PAGE_DOWN))
+    {
+      console_scroll(key == SCAN_PAGE_UP ? -KEYBOARD_SCROLL_ROWS : KEYBOARD_SCROLL_ROWS);
+    }
+
+    return 0;
+  }
+
+  if(key == SCAN_LEFT_SHIFT || key == SCAN_RIGHT_SHIFT)
+  {
+    u32 bit = key == SCAN_LEFT_SHIFT ? 1 : 2;
+
+    keyboard_shift = released ? keyboard_shift & ~bit : keyboard_shift | bit;
+    return 0;
+  }
+
+  if(released)
+  {
+    return 0;
+  }
+
+  if(key == SCAN_CAPS_LOCK)
+  {
+    keyboard_caps_lock = !keyboard_caps_lock;
+    return 0;
+  }
+
+  if(key >= sizeof(scan_chars) - 1)
+  {
+    return 0;
+  }
+
+  char c = keyboard_shift ? scan_chars_shift[key] : scan_chars[key];
+
+  // caps lock only shifts letters
+  if(keyboard_caps_lock && ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')))
+  {
+    c ^= 0x20;
+  }
+
+  return c;
+}
+
+// drains the controller, a byte left in it would keep the edge triggered irq from coming again,
+// returns 1 if the woken reader preempts the running task
+u32 keyboard_interrupt(struct TrapFrame* frame)
+{
+  struct Cpu* cpu = cpu_current();
+  u32 head = keyboard_head;
+
+  TRACE(cpu, TRACE_IRQ, KEYBOARD_IRQ);
+
+  for(u8 status = inb(PS2_STATUS); status & PS2_STATUS_OUTPUT; status = inb(PS2_STATUS))
+  {
+    u8 code = inb(PS2_DATA);
+    char c = status & PS2_STATUS_AUX ? 0 : keyboard_translate(code);
+
+    if(c == 0)
+    {
+      continue;
+    }
+
+    if(head - keyboard_tail == KEYBOARD_RING_SIZE)
+    {
+      ++keyboard_dropped;
+      continue;
+    }
+
+    keyboard_ring[head++ & (KEYBOARD_RING_SIZE - 1)] = c;
+  }
+
+  irq_eoi(KEYBOARD_IRQ);
+
+  if(head == keyboard_head)
+  {
+    return 0;
+  }
+
+  asm volatile("" ::: "memory"); // the characters are stored before head passes them
+  keyboard_head = head;
+
+  wait_wake(cpu, &keyboard_wait);
+
+  return run_queue_preempts(cpu);
+}
+
+// bytes the bios left in the controller
+void init_keyboard()
+{
+  while(inb(PS2_STATUS) & PS2_STATUS_OUTPUT)
+  {
+    inb(PS2_DATA);
+  }
+}
+
+// an exited reader leaves the keyboard to the next task that reads
+void keyboard_release(struct Task* task)
+{
+  if(keyboard_reader == task)
+  {
+    __sync_bool_compare_and_swap(&keyboard_wait.task, task, 0);
+    keyboard_reader = 0;
+  }
+}
+
+u32 syscall_read(u32 buffer, u32 size, u32 a2)
+{
+  struct Cpu* cpu = cpu_current();
+  struct Task* task = cpu->task;
+
+  if((keyboard_reader != task && !__sync_bool_compare_and_swap(&keyboard_reader, 0, task)) || !user_writeable(buffer, size))
+  {
+    return -1;
+  }
+
+  u32 tail = keyboard_tail;
+
+  if(size && tail == keyboard_head)
+  {
+    task_block(cpu, task, &keyboard_wait);
+    return SYSCALL_AGAIN;
+  }
+
+  asm volatile("" ::: "memory"); // the characters are read after head passed them
+
+  u32 n = 0;
+
+  while(n < size && tail != keyboard_head)
+  {
+    ((char*) buffer)[n++] = keyboard_ring[tail++ & (KEYBOARD_RING_SIZE - 1)];
+  }
+
+  keyboard_tail = tail;
+
+  return n;
+}
+
+#ifdef BENCH
+u32 syscall_bench(u32 bench, u32 arg, u32 a2);
+#endif
+
+typedef u32 (*Syscall)(u32 a0, u32 a1, u32 a2);
+
+Syscall syscall_table[NUM_SYSCALLS] =
+{
+  syscall_null,
+  syscall_print,
+  syscall_print_hex,
+  syscall_sleep,
+#ifdef BENCH
+  syscall_bench,
+#else
+  0,
+#endif
+  syscall_trace,
+  syscall_profile,
+  syscall_brk,
+  syscall_fork,
+  syscall_spawn,
+  syscall_exit,
+  syscall_channel,
+  syscall_send,
+  syscall_send_page,
+  syscall_recv,
+  syscall_read,
+};
+
+// returns 1 if the task gave up the cpu and has to be switched away from
+u32 syscall_dispatch(struct TaskFrame* frame)
+{
+  struct Cpu* cpu = cpu_current();
+  u32 n = frame->eax;
+
+  TRACE(cpu, TRACE_SYSCALL, n);
+
+  cpu->syscall_frame = frame;
+
+  if(n < NUM_SYSCALLS && syscall_table[n])
+  {
+    frame->eax = syscall_table[n](frame->ebx, frame->esi, frame->edi);
+  }
+  else
+  {
+    frame->eax = -1;
+  }
+
+  TRACE(cpu, TRACE_SYSCALL_END, frame->eax);
+
+  u32 resched = cpu->resched;
+  cpu->resched = 0;
+
+  return resched;
+}
+
+__attribute__((naked)) void syscall_interrupt_handler()
+{
+  asm volatile("pusha");
+  asm volatile("push %esp");
+  asm volatile("call syscall_dispatch");
+  asm volatile("add $4, %esp");
+  asm volatile("test %eax, %eax");
+  asm volatile("popa"); // does not change the flags
+  asm volatile("jnz task_switch");
+  asm volatile("iret");
+}
+
+// sysenter enters with esp at tss.esp0 of the cpu and does not save anything,
+// so the entry builds the frame int 0x80 would have left, a task switch resumes the task with iret
+__attribute__((naked)) void sysenter_entry()
+{
+  asm volatile("mov (%esp), %esp"); // kernel stack of the running task
+  asm volatile("push $0x23");       // user ss
+  asm volatile("push %ecx");        // user esp
+  asm volatile("push $0x202");      // eflags, sysexit does not restore them
+  asm volatile("push $0x1b");       // user cs
+  asm volatile("push %edx");        // user eip
+  asm volatile("pusha");
+  asm volatile("push %esp");
+  asm volatile("call syscall_dispatch");
+  asm volatile("add $4, %esp");
+  asm volatile("test %eax, %eax");
+  asm volatile("popa");
+  asm volatile("jnz task_switch");
+  asm volatile("mov 0(%esp), %edx");
+  asm volatile("mov 12(%esp), %ecx");
+  asm volatile("sti"); // takes effect after sysexit
+  asm volatile("sysexit");
+}
+
+#define IA32_SYSENTER_CS  0x174
+#define IA32_SYSENTER_ESP 0x175
+#define IA32_SYSENTER_EIP 0x176
+
+#define CPUID_EDX_SEP ( 1 << 11 )
+
+// sysexit derives the user selectors from SYSENTER_CS, so the gdt has kernel code, kernel data, user code and user data in this order
+void init_cpu_syscalls(struct Cpu* cpu)
+{
+  u32 eax, ebx, ecx, edx;
+  cpuid(1, &eax, &ebx, &ecx, &edx);
+
+  if(!(edx & CPUID_EDX_SEP))
+  {
+    return;
+  }
+
+  wrmsr(IA32_SYSENTER_CS, 0x08);
+  wrmsr(IA32_SYSENTER_ESP, (u32) &cpu->tss.esp0);
+  wrmsr(IA32_SYSENTER_EIP, (u32) sysenter_entry);
+
+  syscall_fast = 1;
+}
+
+void init_syscalls()
+{
+  init_cpu_syscalls(&cpus[0]);
+}
+
+void enable_interrupts(u32 pIDTR)
+{
+  asm volatile ("lidt (%0);" :: "a"(pIDTR)); // EFLAGS.IF will be set with the first task switch 
+}
+
+void set_interrupt_handler(u8 idx, u32 handler)
+{
+    struct InterruptDescriptor* id = &interrupt_descriptor_table[idx];
+
+    id->selector = 0x0008; // code segment
+    id->offset0  = 0x0000ffff & handler;
+    id->offset1  = handler >> 16;
+    id->flags    = 0x8e00; // type of descriptor (32 bit interrupt call gate)
+}
+
+void init_interrupt_handlers()
+{
+  remap_pic(); // pic master: 32-39, pic slave: 40-47 
+
+  for(int i = 0; i < NUM_INTERRUPT_DESCRIPTORS; ++i)
+  {
+    set_interrupt_handler(i, (u32) interrupt_stubs + i * INTERRUPT_STUB_SIZE);
+    register_interrupt_handler(i, i < NUM_EXCEPTIONS ? exception_handler : unhandled_interrupt);
+
+    for(u32 cpu = 0; cpu < MAX_CPUS; ++cpu)
+    {
+      stats_reset(&interrupt_stats[cpu][i]);
+    }
+  }
+
+  register_interrupt_handler(3, breakpoint);
+  register_interrupt_handler(7, fpu_trap);
+  register_interrupt_handler(14, page_fault);
+  register_interrupt_handler(IRQ_BASE, timer_interrupt); // the pit or the local apic timer, programmed by init_timer
+  register_interrupt_handler(IRQ_BASE + KEYBOARD_IRQ, keyboard_interrupt);
+  register_interrupt_handler(IRQ_BASE + COM1_IRQ, serial_interrupt);
+  register_interrupt_handler(SPURIOUS_VECTOR, spurious_interrupt);
+
+  // system calls enter directly, they do not need the trap frame
+  set_interrupt_handler(SYSCALL_VECTOR, (u32) syscall_interrupt_handler);
+  interrupt_descriptor_table[SYSCALL_VECTOR].flags = 0xee00; // dpl 3, callable from user mode
+
+  idtr.base = (u32) &interrupt_descriptor_table;
+  idtr.limit = sizeof(struct InterruptDescriptor) * NUM_INTERRUPT_DESCRIPTORS - 1;
+
+  enable_interrupts((u32) &idtr);
+}
+
+// a cpu enters the scheduler with its stack empty, the interrupt frame it pushes becomes the first frame of the idle task
+__attribute__((naked)) void enter_scheduler(struct Cpu* cpu)
+{
+  asm volatile("mov 4(%esp), %eax");
+  asm volatile("lea %c0(%%eax), %%esp" :: "i"(KERNEL_STACK_SIZE * sizeof(u32)));
+  asm volatile("pushl $0x202"); // eflags
+  asm volatile("pushl $0x08");  // cs
+  asm volatile("pushl $cpu_idle");
+  asm volatile("jmp task_switch");
+}
+
+// application processors are started with the init - startup - startup sequence,
+// they begin in real mode at the page given in the startup ipi
+#define AP_TRAMPOLINE_ADDR 0x1000
+
+#define LAPIC_ICR_INIT     0x4500 // init, level assert
+#define LAPIC_ICR_STARTUP  0x4600 // startup, the vector is the page number of the start address
+#define LAPIC_ICR_PENDING  ( 1 << 12 )
+
+u32 ap_stack; // initial stack pointer of the starting application processor
+u32 volatile ap_started;
+u32 volatile smp_go; // set once the bootstrap processor enters the scheduler
+
+extern u8 ap_trampoline[];
+extern u8 ap_trampoline_end[];
+
+// copied to AP_TRAMPOLINE_ADDR, so addresses inside are relative to ap_trampoline
+asm(
+  ".pushsection .text\n"
+  ".code16\n"
+  "ap_trampoline:\n"
+  "  cli\n"
+  "  xor %ax, %ax\n"
+  "  mov %ax, %ds\n"
+  "  lgdtl " STR(AP_TRAMPOLINE_ADDR) " + ap_trampoline_gdtr - ap_trampoline\n"
+  "  mov %cr0, %eax\n"
+  "  or $1, %eax\n"
+  "  mov %eax, %cr0\n"
+  "  ljmpl $0x8, $ap_protected_mode\n"
+  "ap_trampoline_gdt:\n"
+  "  .quad 0x0000000000000000\n"
+  "  .quad 0x00cf9a000000ffff\n" // flat code
+  "  .quad 0x00cf92000000ffff\n" // flat data
+  "ap_trampoline_gdtr:\n"
+  "  .word ap_trampoline_gdtr - ap_trampoline_gdt - 1\n"
+  "  .long " STR(AP_TRAMPOLINE_ADDR) " + ap_trampoline_gdt - ap_trampoline\n"
+  "ap_trampoline_end:\n"
+  ".code32\n"
+  "ap_protected_mode:\n"
+  "  mov $0x10, %ax\n"
+  "  mov %ax, %ds\n"
+  "  mov %ax, %es\n"
+  "  mov %ax, %fs\n"
+  "  mov %ax, %gs\n"
+  "  mov %ax, %ss\n"
+  "  mov ap_stack, %esp\n"
+  "  call ap_main\n"
+  ".popsection\n"
+);
+
+#ifdef BENCH
+void bench_smp_ap(struct Cpu* cpu);
+#endif
+
+void ap_main()
+{
+  if(paging_large_pages)
+  {
+    write_cr4(read_cr4() | CR4_PSE | CR4_PGE);
+  }
+
+  write_cr3((u32) &page_dir);
+  enable_paging();
+
+  struct Cpu* cpu = cpu_current();
+
+  init_cpu_gdt(cpu);
+  asm volatile ("lidt (%0);" :: "a"((u32) &idtr));
+  init_lapic();
+  timer_init_cpu();
+  init_fpu();
+  init_cpu_syscalls(cpu);
+
+  cpu->online = 1;
+  ap_started = 1;
+
+#ifdef BENCH
+  bench_smp_ap(cpu);
+#endif
+
+  while(!smp_go)
+  {
+    asm volatile("pause");
+  }
+
+  init_idle_task(cpu);
+  enter_scheduler(cpu);
+}
+
+void lapic_send_ipi(u32 apic_id, u32 icr)
+{
+  lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+  lapic_write(LAPIC_ICR_LOW, icr);
+
+  while(lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING);
+}
+
+// starts the application processors listed in the madt, one at a time on their own kernel stack
+void init_smp()
+{
+  cpus[0].apic_id = apic_enabled ? lapic_read(LAPIC_ID) >> 24 : 0;
+  cpus[0].online = 1;
+  cpus[0].stack[0] = (u32) &cpus[0];
+
+  if(!apic_enabled)
+  {
+    return;
+  }
+
+  for(u32 i = 0; i < ap_trampoline_end - ap_trampoline; ++i)
+  {
+    ((u8*) AP_TRAMPOLINE_ADDR)[i] = ap_trampoline[i];
+  }
+
+  for(u32 i = 0; i < acpi_num_cpus && num_cpus < MAX_CPUS; ++i)
+  {
+    if(acpi_cpu_apic_ids[i] == cpus[0].apic_id)
+    {
+      continue;
+    }
+
+    struct Cpu* cpu = &cpus[num_cpus];
+    cpu->id = num_cpus;
+    cpu->apic_id = acpi_cpu_apic_ids[i];
+    cpu->stack[0] = (u32) cpu;
+
+    ap_stack = (u32) &cpu->stack[KERNEL_STACK_SIZE];
+    ap_started = 0;
+
+    lapic_send_ipi(cpu->apic_id, LAPIC_ICR_INIT);
+    pit_wait(PIT_FREQUENCY / 100); // 10 ms
+
+    for(u32 sipi = 0; sipi < 2 && !ap_started; ++sipi)
+    {
+      lapic_send_ipi(cpu->apic_id, LAPIC_ICR_STARTUP | (AP_TRAMPOLINE_ADDR / PAGE_SIZE));
+
+      for(u32 wait = 0; wait < 100 && !ap_started; ++wait)
+      {
+        pit_wait(PIT_FREQUENCY / 10000); // 100 us
+      }
+    }
+
+    if(ap_started)
+    {
+      ++num_cpus;
+    }
+  }
+}
+
+// hands the tasks round robin to the online cpus and enters the scheduler on the bootstrap processor
+void switch_to_user_mode()
+{
+  for(u32 i = 0; i < NUM_TASKS; ++i)
+  {
+    run_queue_push(&cpus[i % num_cpus], &tasks[i]);
+  }
+
+#ifdef TRACE_ON_BOOT
+  trace_enabled = trace_ready;
+#endif
+
+#ifdef PROFILE_ON_BOOT
+  profile_enabled = profile_ready;
+#endif
+
+  smp_go = 1;
+  init_idle_task(&cpus[0]);
+  enter_scheduler(&cpus[0]);
+}
+
+// the 32 KiB text buffer holds more rows than the screen shows, the crtc start address selects the visible ones,
+// so a new line scrolls by moving the start address instead of copying the screen.
+// output goes to a shadow of the text buffer first and the written span is copied to video memory once per call
+#define NUM_ROWS 25
+#define NUM_COLS 80
+#define CONSOLE_ROWS 200 // rows of the text buffer
+#define CONSOLE_KEEP 100 // rows moved to the top once the text buffer is full
+#define CONSOLE_ATTR 128
+
+#define CRTC_INDEX     0x3d4
+#define CRTC_DATA      0x3d5
+#define CRTC_START     0x0c // high byte, the low byte follows
+#define CRTC_CURSOR    0x0e // high byte, the low byte follows
+
+u16 console_shadow[CONSOLE_ROWS * NUM_COLS]; // video memory is never read back
+u16* const console_vga = (u16*) VGA_MEMORY_START;
+
+u32 console_row;         // row of the cursor in the text buffer
+u32 console_col;
+u32 console_top;         // first visible row
+u32 console_dirty_start; // cells written to the shadow but not to video memory
+u32 console_dirty_end;
+u32 console_shown_top;   // crtc registers are only written when they change
+u32 console_shown_cursor;
+
+Spinlock console_lock; // all cpus print to the same screen
+
+void crtc_write(u8 reg, u16 val)
+{
+  outb(CRTC_INDEX, reg);
+  outb(CRTC_DATA, val >> 8);
+  outb(CRTC_INDEX, reg + 1);
+  outb(CRTC_DATA, val & 0xff);
+}
+
+void console_mark(u32 from, u32 to)
+{
+  if(from < console_dirty_start)
+  {
+    console_dirty_start = from;
+  }
+
+  if(to > console_dirty_end)
+  {
+    console_dirty_end = to;
+  }
+}
+
+// first visible row if the cursor is on the last visible row
+u32 console_bottom()
+{
+  return console_row < NUM_ROWS ? 0 : console_row - NUM_ROWS + 1;
+}
+
+void console_flush()
+{
+  if(console_dirty_start < console_dirty_end)
+  {
+    // two cells per word, the shadow is a copy of the whole text buffer, so rounding is harmless
+    u32 from = console_dirty_start & ~1;
+    u32 to = (console_dirty_end + 1) & ~1;
+
+    copy_u32(console_vga + from, console_shadow + from, (to - from) / 2);
+
+    console_dirty_start = CONSOLE_ROWS * NUM_COLS;
+    console_dirty_end = 0;
+  }
+
+  if(console_top != console_shown_top)
+  {
+    crtc_write(CRTC_START, console_top * NUM_COLS);
+    console_shown_top = console_top;
+  }
+
+  u32 cursor = console_row * NUM_COLS + console_col;
+
+  if(cursor != console_shown_cursor)
+  {
+    crtc_write(CRTC_CURSOR, cursor);
+    console_shown_cursor = cursor;
+  }
+}
+
+void console_new_line()
+{
+  console_col = 0;
+  ++console_row;
+
+  if(console_row == CONSOLE_ROWS)
+  {
+    copy_u32(console_shadow, console_shadow + (CONSOLE_ROWS - CONSOLE_KEEP) * NUM_COLS, CONSOLE_KEEP * NUM_COLS / 2);
+    console_mark(0, CONSOLE_KEEP * NUM_COLS);
+    console_row = CONSOLE_KEEP;
+  }
+
+  // the row may hold output from before the text buffer was full
+  fill_u32(console_shadow + console_row * NUM_COLS, 0, NUM_COLS / 2);
+  console_mark(console_row * NUM_COLS, (console_row + 1) * NUM_COLS);
+
+  console_top = console_bottom();
+}
+
+void console_write(char const* s, u32 length)
+{
+  spin_lock(&console_lock);
+
+  console_top = console_bottom();
+
+  for(u32 i = 0; i < length; ++i)
+  {
+    if(s[i] == '\n')
+    {
+      console_new_line();
+      continue;
+    }
+
+    u32 cell = console_row * NUM_COLS + console_col;
+
+    console_shadow[cell] = (CONSOLE_ATTR << 8) | (u8) s[i];
+    console_mark(cell, cell + 1);
+
+    if(++console_col == NUM_COLS)
+    {
+      console_new_line();
+    }
+  }
+
+  console_flush();
+  serial_write(s, length);
+
+  spin_unlock(&console_lock);
+}
+
+// moves the view into the rows still held by the text buffer, the next output moves it back
+void console_scroll(i32 rows)
+{
+  spin_lock(&console_lock);
+
+  i32 top = (i32) console_top + rows;
+  i32 bottom = (i32) console_bottom();
+
+  console_top = top < 0 ? 0 : top > bottom ? (u32) bottom : (u32) top;
+  console_flush();
+
+  spin_unlock(&console_lock);
+}
+
+void put_char(char c) 
+{
+  console_write(&c, 1);
+}
+
+void print(char const* s) 
+{
+  u32 length = 0;
+
+  while(s[length] != 0)
+  {
+    ++length;
+  }
+
+  console_write(s, length);
+}
+
+void clear_screen()
+{
+  spin_lock(&console_lock);
+
+  fill_u32(console_shadow, 0, CONSOLE_ROWS * NUM_COLS / 2);
+
+  console_row = 0;
+  console_col = 0;
+  console_top = 0;
+  console_dirty_start = 0;
+  console_dirty_end = CONSOLE_ROWS * NUM_COLS;
+
+  // the bootloader may have left the crtc registers anywhere
+  console_shown_top = -1;
+  console_shown_cursor = -1;
+
+  console_flush();
+
+  spin_unlock(&console_lock);
+}
+
+#ifdef BENCH
+
+// allocates every free frame, checks that no frame is handed out twice and frees them again
+void bench_frames()
+{
+  struct CycleStats alloc;
+  struct CycleStats free;
+  stats_reset(&alloc);
+  stats_reset(&free);
+
+  u32 num_free = frame_num_free;
+  u32 list = 0; // allocated frames are linked through their first word
+
+  while(1)
+  {
+    u64 t0 = rdtsc();
+    u32 frame = frame_alloc();
+    u64 t1 = rdtsc();
+
+    if(frame == 0)
+    {
+      break;
+    }
+
+    stats_add(&alloc, (u32) (t1 - t0));
+
+    *(u32*) frame = list;
+    list = frame;
+  }
+
+  if(alloc.count != num_free)
+  {
+    print("frame allocator lost frames\n");
+  }
+
+  // free every second frame first to fragment the bitmap, then the rest
+  for(u32 pass = 0; pass < 2; ++pass)
+  {
+    u32* link = &list;
+
+    while(*link)
+    {
+      u32 frame = *link;
+      u32 next = *(u32*) frame;
+      u32 odd = (frame / PAGE_SIZE) & 1;
+
+      if(pass == 1 || odd)
+      {
+        *link = next;
+
+        u64 t0 = rdtsc();
+        frame_free(frame);
+        u64 t1 = rdtsc();
+
+        stats_add(&free, (u32) (t1 - t0));
+      }
+      else
+      {
+        link = (u32*) frame;
+      }
+    }
+
+    if(pass == 0)
+    {
+      // refill the holes, the search has to skip the fragmented bitmap words
+      struct CycleStats refill;
+      stats_reset(&refill);
+
+      for(u32 i = 0; i < 1024; ++i)
+      {
+        u64 t0 = rdtsc();
+        u32 frame = frame_alloc();
+        u64 t1 = rdtsc();
+
+        if(frame == 0)
+        {
+          break;
+        }
+
+        stats_add(&refill, (u32) (t1 - t0));
+
+        *(u32*) frame = list;
+        list = frame;
+      }
+
+      print_stats("frame_alloc fragmented", &refill);
+    }
+  }
+
+  if(frame_num_free != num_free)
+  {
+    print("frame allocator leaked frames\n");
+  }
+
+  print_stats("frame_alloc", &alloc);
+  print_stats("frame_free", &free);
+}
+
+// kmalloc of mixed sizes, the share of the slab pages that holds requested bytes with all objects allocated and after
+// every second one was freed, once all are freed only the last slab of every cache is kept
+#define BENCH_SLAB_OBJECTS 2048
+
+void* bench_slab_objects[BENCH_SLAB_OBJECTS];
+u32 bench_slab_sizes[BENCH_SLAB_OBJECTS];
+
+u32 kmalloc_pages()
+{
+  u32 pages = 0;
+
+  for(u32 i = 0; i < KMALLOC_CACHES; ++i)
+  {
+    pages += kmalloc_caches[i].slabs;
+  }
+
+  return pages;
+}
+
+void bench_slab_utilization(char const* name, u32 requested)
+{
+  u32 pages = kmalloc_pages();
+
+  print_result(name, "utilization", pages ? requested * 100 / (pages * PAGE_SIZE) : 0);
+}
+
+void bench_slab()
+{
+  struct CycleStats alloc;
+  struct CycleStats free;
+  struct CycleStats hot;
+  stats_reset(&alloc);
+  stats_reset(&free);
+  stats_reset(&hot);
+
+  u32 seed = 1;
+  u32 requested = 0;
+
+  for(u32 i = 0; i < BENCH_SLAB_OBJECTS; ++i)
+  {
+    seed = seed * 1103515245 + 12345;
+    bench_slab_sizes[i] = 8 + (seed >> 16) % 1017;
+
+    u64 t0 = rdtsc();
+    bench_slab_objects[i] = kmalloc(bench_slab_sizes[i]);
+    u64 t1 = rdtsc();
+
+    if(bench_slab_objects[i] == 0)
+    {
+      print("kmalloc out of memory\n");
+      return;
+    }
+
+    stats_add(&alloc, (u32) (t1 - t0));
+    requested += bench_slab_sizes[i];
+  }
+
+  bench_slab_utilization("kmalloc mixed sizes", requested);
+
+  for(u32 pass = 0; pass < 2; ++pass)
+  {
+    for(u32 i = pass; i < BENCH_SLAB_OBJECTS; i += 2)
+    {
+      u64 t0 = rdtsc();
+      kfree(bench_slab_objects[i]);
+      u64 t1 = rdtsc();
+
+      stats_add(&free, (u32) (t1 - t0));
+      requested -= bench_slab_sizes[i];
+    }
+
+    if(pass == 0)
+    {
+      bench_slab_utilization("kmalloc half freed", requested);
+    }
+  }
+
+  print_result("kmalloc all freed", "pages", kmalloc_pages());
+
+  // the same object again and again, as for short lived buffers
+  for(u32 i = 0; i < 1000; ++i)
+  {
+    u64 t0 = rdtsc();
+    void* object = kmalloc(64);
+    kfree(object);
+    u64 t1 = rdtsc();
+
+    stats_add(&hot, (u32) (t1 - t0));
+  }
+
+  print_stats("kmalloc", &alloc);
+  print_stats("kfree", &free);
+  print_stats("kmalloc kfree hot", &hot);
+}
+
+// reads one word per page of kernel memory after flushing the non global tlb entries, as every address space switch does
+void bench_kernel_walk(char const* name, u32 from, u32 to)
+{
+  struct CycleStats walk;
+  stats_reset(&walk);
+
+  for(u32 round = 0; round < 16; ++round)
+  {
+    write_cr3(read_cr3());
+
+    u64 t0 = rdtsc();
+
+    for(u32 addr = from; addr < to; addr += PAGE_SIZE)
+    {
+      *(u32 volatile*) addr;
+    }
+
+    u64 t1 = rdtsc();
+
+    stats_add(&walk, (u32) (t1 - t0));
+  }
+
+  print_stats(name, &walk);
+}
+
+void bench_set_large_pages(u32 from, u32 to, u32 on)
+{
+  paging_large_pages = on;
+  map_identity(page_dir, from, to, PTE_WRITEABLE | (on ? PTE_GLOBAL : 0));
+
+  // toggling global pages flushes the whole tlb, including global entries
+  write_cr4(read_cr4() & ~CR4_PGE);
+
+  if(on)
+  {
+    write_cr4(read_cr4() | CR4_PGE);
+  }
+}
+
+void bench_large_pages()
+{
+  if(!paging_large_pages)
+  {
+    print("large pages not supported\n");
+    return;
+  }
+
+  u32 from = round_up(round_up((u32) &_bss_end, PAGE_SIZE), LARGE_PAGE_SIZE);
+  u32 to = round_down(frame_memory_end, LARGE_PAGE_SIZE);
+
+  if(to > from + 16 * LARGE_PAGE_SIZE)
+  {
+    to = from + 16 * LARGE_PAGE_SIZE;
+  }
+
+  bench_kernel_walk("kernel walk 4M global", from, to);
+
+  bench_set_large_pages(from, to, 0);
+  bench_kernel_walk("kernel walk 4K", from, to);
+
+  bench_set_large_pages(from, to, 1);
+  bench_kernel_walk("kernel walk 4M global", from, to);
+}
+
+// one load right after its tlb entry was invalidated, so the cpu walks the page tables, and the same load hitting the tlb
+void bench_page_walk(char const* name, u32 addr)
+{
+  struct CycleStats walk;
+  struct CycleStats hit;
+  stats_reset(&walk);
+  stats_reset(&hit);
+
+  for(u32 i = 0; i < 1000; ++i)
+  {
+    asm volatile ("invlpg (%0)" :: "r"(addr) : "memory");
+
+    u64 t0 = rdtsc();
+    *(u32 volatile*) addr;
+    u64 t1 = rdtsc();
+    *(u32 volatile*) addr;
+    u64 t2 = rdtsc();
+
+    stats_add(&walk, (u32) (t1 - t0));
+    stats_add(&hit, (u32) (t2 - t1));
+  }
+
+  print_stats(name, &walk);
+  print_stats("load tlb hit", &hit);
+}
+
+void bench_page_walks()
+{
+  bench_page_walk("load page walk 4K", (u32) &frame_num_free);
+
+  if(paging_large_pages)
+  {
+    bench_page_walk("load page walk 4M", round_up(round_up((u32) &_bss_end, PAGE_SIZE), LARGE_PAGE_SIZE));
+  }
+}
+
+// int3 raises a breakpoint trap, whose handler returns at once
+void bench_exception()
+{
+  struct CycleStats trap;
+  stats_reset(&trap);
+
+  for(u32 i = 0; i < 1000; ++i)
+  {
+    u64 t0 = rdtsc();
+
+    asm volatile ("int3");
+
+    u64 t1 = rdtsc();
+
+    stats_add(&trap, (u32) (t1 - t0));
+  }
+
+  print_stats("exception round trip int3", &trap);
+}
+
+// switches between the address spaces of two tasks and touches the user stack and some kernel data
+void bench_address_space_switch(char const* name, u32 reload)
+{
+  struct CycleStats sw;
+  stats_reset(&sw);
+
+  u32 kernel_cr3 = read_cr3();
+
+  // user stacks are mapped on demand, but the kernel must not fault on them
+  for(u32 i = 0; i < 2; ++i)
+  {
+    write_cr3(tasks[i].cr3);
+
+    if(!(lookup_page(USER_STACK_TOP - PAGE_SIZE) & PTE_PRESENT))
+    {
+      task_map_demand(&tasks[i], USER_STACK_TOP - PAGE_SIZE);
+    }
+  }
+
+  for(u32 i = 0; i < 1000; ++i)
+  {
+    struct Task* task = &tasks[reload ? i % 2 : 0];
+
+    u64 t0 = rdtsc();
+
+    if(task->cr3 != read_cr3())
+    {
+      write_cr3(task->cr3);
+    }
+
+    *(u32 volatile*) (USER_STACK_TOP - sizeof(u32)) += 1;
+    *(u32 volatile*) &task->frame;
+    *(u32 volatile*) &cpus[0].tss.esp0;
+    *(char volatile*) VGA_MEMORY_START;
+
+    u64 t1 = rdtsc();
+
+    stats_add(&sw, (u32) (t1 - t0));
+  }
+
+  write_cr3(kernel_cr3);
+
+  print_stats(name, &sw);
+}
+
+// cpu bound jobs are queued on the bootstrap processor and spread by work stealing,
+// the jobs are only run queue entries, so the scaling of the run queues is measured without the user tasks
+#define BENCH_SMP_JOBS  256
+#define BENCH_SMP_WORK  20000
+#define BENCH_SMP_END   0xffffffff
+
+struct Task bench_smp_jobs[BENCH_SMP_JOBS];
+u32 volatile bench_smp_round; // a new round starts the application processors, BENCH_SMP_END releases them
+u32 volatile bench_smp_cpus;  // cpus that take part in the round
+u32 volatile bench_smp_done;  // cpus that found no more work
+u32 bench_smp_jobs_run[MAX_CPUS];
+
+void bench_smp_work(struct Cpu* cpu)
+{
+  while(1)
+  {
+    struct Task* job = run_queue_pop(cpu);
+
+    if(job == 0)
+    {
+      job = run_queue_steal(cpu, 1);
+    }
+
+    if(job == 0)
+    {
+      break;
+    }
+
+    for(u32 volatile i = 0; i < BENCH_SMP_WORK; ++i);
+
+    ++bench_smp_jobs_run[cpu->id];
+  }
+
+  __sync_fetch_and_add(&bench_smp_done, 1);
+}
+
+void bench_smp_ap(struct Cpu* cpu)
+{
+  u32 round = 0;
+
+  while(1)
+  {
+    while(bench_smp_round == round)
+    {
+      asm volatile("pause");
+    }
+
+    round = bench_smp_round;
+
+    if(round == BENCH_SMP_END)
+    {
+      return;
+    }
+
+    if(cpu->id < bench_smp_cpus)
+    {
+      bench_smp_work(cpu);
+    }
+  }
+}
+
+void bench_smp()
+{
+  for(u32 n = 1; n <= num_cpus; ++n)
+  {
+    for(u32 i = 0; i < BENCH_SMP_JOBS; ++i)
+    {
+      run_queue_push(&cpus[0], &bench_smp_jobs[i]);
+    }
+
+    for(u32 i = 0; i < MAX_CPUS; ++i)
+    {
+      bench_smp_jobs_run[i] = 0;
+    }
+
+    bench_smp_cpus = n;
+    bench_smp_done = 0;
+
+    u64 t0 = rdtsc();
+
+    ++bench_smp_round;
+    bench_smp_work(&cpus[0]);
+
+    while(bench_smp_done < n)
+    {
+      asm volatile("pause");
+    }
+
+    u64 t1 = rdtsc();
+
+    u32 kcycles = div_u64(t1 - t0, 1000);
+
+    print("bench smp ");
+    put_u32(n);
+    print(" cpus kcycles:");
+    put_u32(kcycles);
+    print(" jobs/mcycle:");
+    put_u32(BENCH_SMP_JOBS * 1000 / (kcycles ? kcycles : 1));
+    print(" stolen:");
+    put_u32(BENCH_SMP_JOBS - bench_smp_jobs_run[0]);
+    print("\n");
+  }
+
+  bench_smp_round = BENCH_SMP_END;
+}
+
+u32 bench_read_addr(u32 addr)
+{
+  return *((u32*) addr);
+}
+
+void bench_write_addr(u32 addr, u32 val)
+{
+  *((u32*) addr) = val;
+}
+
+// the register copy the switch path did before frames were switched by stack pointer, one call per word in and out
+void bench_frame_copy()
+{
+  struct CycleStats copy;
+  stats_reset(&copy);
+
+  struct TaskFrame frame;
+  struct TaskFrame saved;
+  u32 from = (u32) &frame;
+  u32 to = (u32) &saved;
+
+  for(u32 i = 0; i < 1000; ++i)
+  {
+    u64 t0 = rdtsc();
+
+    for(u32 offset = 0; offset < sizeof(struct TaskFrame); offset += sizeof(u32))
+    {
+      if(offset != 12) // esp
+      {
+        bench_write_addr(to + offset, bench_read_addr(from + offset));
+      }
+    }
+
+    for(u32 offset = 0; offset < sizeof(struct TaskFrame); offset += sizeof(u32))
+    {
+      if(offset != 12)
+      {
+        bench_write_addr(from + offset, bench_read_addr(to + offset));
+      }
+    }
+
+    u64 t1 = rdtsc();
+
+    stats_add(&copy, (u32) (t1 - t0));
+  }
+
+  print_stats("frame copy of the old switch path", &copy);
+}
+
+// requeues the running task and picks the next one as schedule does, with a few or many waiting tasks spread over the priorities
+void bench_run_queue(char const* name, u32 waiting)
+{
+  struct CycleStats pick;
+  stats_reset(&pick);
+
+  struct Cpu* cpu = &cpus[0];
+
+  for(u32 i = 0; i < waiting; ++i)
+  {
+    bench_smp_jobs[i].priority = i % NUM_PRIORITIES;
+    run_queue_push(cpu, &bench_smp_jobs[i]);
+  }
+
+  struct Task* task = run_queue_pop(cpu);
+
+  for(u32 i = 0; i < 1000; ++i)
+  {
+    u64 t0 = rdtsc();
+    run_queue_push(cpu, task);
+    task = run_queue_pop(cpu);
+    u64 t1 = rdtsc();
+
+    stats_add(&pick, (u32) (t1 - t0));
+  }
+
+  while(run_queue_pop(cpu));
+
+  for(u32 i = 0; i < waiting; ++i)
+  {
+    bench_smp_jobs[i].priority = PRIORITY_DEFAULT;
+  }
+
+  print_stats(name, &pick);
+}
+
+// the console before the shadow buffer: one store per byte and a screen cleared byte by byte instead of scrolled,
+// it writes to the last rows of the text buffer, which are off screen unless the console reached them
+#define BENCH_CONSOLE_LINES 100
+
+u32 legacy_row;
+u32 legacy_col;
+
+void legacy_put_char(char c)
+{
+  char* base = (char*) (console_vga + (CONSOLE_ROWS - NUM_ROWS) * NUM_COLS);
+
+  spin_lock(&console_lock);
+
+  if(c == '\n')
+  {
+    legacy_col = 0;
+    ++legacy_row;
+    if(legacy_row >= NUM_ROWS)
+    {
+      for(char* p = base; p < base + NUM_ROWS * NUM_COLS * 2; ++p)
+      {
+        *p = 0;
+      }
+      legacy_row = 0;
+    }
+    spin_unlock(&console_lock);
+    return;
+  }
+
+  *(base + (legacy_row * NUM_COLS + legacy_col) * 2 + 0) = c;
+  *(base + (legacy_row * NUM_COLS + legacy_col) * 2 + 1) = CONSOLE_ATTR;
+
+  ++legacy_col;
+
+  if(legacy_col >= NUM_COLS)
+  {
+    legacy_col = 0;
+    ++legacy_row;
+  }
+
+  spin_unlock(&console_lock);
+}
+
+void print_throughput(char const* name, struct CycleStats* s, u32 chars_per_line)
+{
+  u64 tsc_hz = (u64) timer_tsc_per_tick * TIMER_HZ;
+  u32 cycles_per_char = (u32) div_u64(s->total, s->count * chars_per_line);
+
+  print_stats(name, s);
+  print_result(name, "chars/s", (u32) div_u64(tsc_hz, cycles_per_char ? cycles_per_char : 1));
+}
+
+void bench_console()
+{
+  char const* line = "the quick brown fox jumps over the lazy dog 0123456789\n";
+  u32 length = 0;
+
+  while(line[length] != 0)
+  {
+    ++length;
+  }
+
+  struct CycleStats legacy;
+  struct CycleStats shadow;
+  stats_reset(&legacy);
+  stats_reset(&shadow);
+
+  for(u32 i = 0; i < BENCH_CONSOLE_LINES; ++i)
+  {
+    u64 t0 = rdtsc();
+
+    for(char const* c = line; *c != 0; ++c)
+    {
+      legacy_put_char(*c);
+    }
+
+    u64 t1 = rdtsc();
+
+    stats_add(&legacy, (u32) (t1 - t0));
+  }
+
+  // restore what the old path overwrote
+  spin_lock(&console_lock);
+  console_mark((CONSOLE_ROWS - NUM_ROWS) * NUM_COLS, CONSOLE_ROWS * NUM_COLS);
+  console_flush();
+  spin_unlock(&console_lock);
+
+  for(u32 i = 0; i < BENCH_CONSOLE_LINES; ++i)
+  {
+    u64 t0 = rdtsc();
+
+    print(line);
+
+    u64 t1 = rdtsc();
+
+    stats_add(&shadow, (u32) (t1 - t0));
+  }
+
+  print_throughput("console line, byte stores", &legacy, length);
+  print_throughput("console line, shadow buffer", &shadow, length);
+}
+
+// cost of a tracepoint, enabled and disabled, the ring of the bootstrap processor is emptied again
+void bench_trace()
+{
+  if(!trace_ready)
+  {
+    return;
+  }
+
+  struct CycleStats stats[2];
+  u32 enabled = trace_enabled;
+
+  for(u32 on = 0; on < 2; ++on)
+  {
+    stats_reset(&stats[on]);
+    trace_enabled = on;
+
+    for(u32 i = 0; i < 1000; ++i)
+    {
+      u64 t0 = rdtsc();
+
+      TRACE(&cpus[0], TRACE_IRQ, 0);
+
+      u64 t1 = rdtsc();
+
+      stats_add(&stats[on], (u32) (t1 - t0));
+    }
+  }
+
+  trace_enabled = enabled;
+  trace_buffer->rings[0].head = 0;
+
+  print_stats("tracepoint disabled", &stats[0]);
+  print_stats("tracepoint enabled", &stats[1]);
+}
+
+// user mode benchmarks run as tasks once the scheduler started and report through SYS_BENCH
+#define BENCH_REPORT_SLEEP   0
+#define BENCH_REPORT_FPU     1
+#define BENCH_REPORT_SYSCALL 2
+#define BENCH_REPORT_FAULT   3
+#define BENCH_REPORT_FORK    4
+#define BENCH_REPORT_SPAWN   5
+#define BENCH_REPORT_IPC     6
+
+u32 bench_tasks_running;
+
+void bench_start_task(u32 priority, u32 eip)
+{
+  struct Task* task = task_alloc();
+
+  if(task == 0)
+  {
+    print("task pool exhausted\n");
+    halt();
+  }
+
+  ++bench_tasks_running;
+  init_task(task, task_pool_id(task), priority, eip);
+
+  __sync_fetch_and_add(&num_runnable_tasks, 1);
+  run_queue_push(&cpus[0], task);
+}
+
+// a high priority task sleeps repeatedly, the kernel measures how late sleeping tasks run after the start of their wakeup tick
+#define BENCH_SLEEP_ROUNDS 100
+
+USER void bench_sleep_main()
+{
+  for(u32 i = 0; i < BENCH_SLEEP_ROUNDS; ++i)
+  {
+    sys_sleep(1 + i % 5);
+  }
+
+  syscall(SYS_BENCH, BENCH_REPORT_SLEEP, 0, 0);
+
+  while(1)
+  {
+    sys_sleep(0xffffffff);
+  }
+}
+
+// tasks keep a value in xmm0 across sleeps and preemption and count every time they find another one there
+#define BENCH_FPU_TASKS  2
+#define BENCH_FPU_ROUNDS 200
+
+u32 bench_fpu_errors;
+u32 bench_fpu_done;
+
+USER void bench_fpu_run(u32 value)
+{
+  u32 errors = 0;
+
+  asm volatile ("movd %0, %%xmm0" :: "r"(value));
+
+  for(u32 i = 0; i < BENCH_FPU_ROUNDS; ++i)
+  {
+    for(u32 volatile spin = 0; spin < 10000; ++spin);
+
+    sys_sleep(i % 2);
+
+    u32 found = 0;
+    asm volatile ("movd %%xmm0, %0" : "=r"(found));
+
+    if(found != value)
+    {
+      ++errors;
+    }
+  }
+
+  syscall(SYS_BENCH, BENCH_REPORT_FPU, errors, 0);
+
+  while(1)
+  {
+    sys_sleep(0xffffffff);
+  }
+}
+
+USER __attribute__((naked)) void bench_fpu_main()
+{
+  asm volatile("push %eax"); // the task id
+  asm volatile("call bench_fpu_run");
+}
+
+// round trips of the null system call through both entry paths
+#define BENCH_SYSCALL_ROUNDS 1000
+
+USER void bench_syscall_main()
+{
+  struct CycleStats stats[2];
+
+  for(u32 path = 0; path < 2; ++path)
+  {
+    stats_reset(&stats[path]);
+
+    for(u32 i = 0; i < BENCH_SYSCALL_ROUNDS && (path == 0 || syscall_fast); ++i)
+    {
+      u64 t0 = rdtsc();
+
+      if(path == 0)
+      {
+        syscall_int(SYS_NULL, 0, 0, 0);
+      }
+      else
+      {
+        syscall_sysenter(SYS_NULL, 0, 0, 0);
+      }
+
+      u64 t1 = rdtsc();
+
+      stats_add(&stats[path], (u32) (t1 - t0));
+    }
+  }
+
+  syscall(SYS_BENCH, BENCH_REPORT_SYSCALL, (u32) stats, 0);
+
+  while(1)
+  {
+    sys_sleep(0xffffffff);
+  }
+}
+
+// the first store to each heap page faults and maps a zeroed frame, the second pass stores to mapped pages,
+// then a store above the break kills the task and only the task
+#define BENCH_FAULT_PAGES 256
+
+USER void bench_fault_main()
+{
+  struct CycleStats stats[2];
+  u8 volatile* heap = sys_sbrk(BENCH_FAULT_PAGES * PAGE_SIZE);
+
+  for(u32 pass = 0; pass < 2; ++pass)
+  {
+    stats_reset(&stats[pass]);
+
+    for(u32 i = 0; i < BENCH_FAULT_PAGES; ++i)
+    {
+      u64 t0 = rdtsc();
+      heap[i * PAGE_SIZE] = 1;
+      u64 t1 = rdtsc();
+
+      stats_add(&stats[pass], (u32) (t1 - t0));
+    }
+  }
+
+  syscall(SYS_BENCH, BENCH_REPORT_FAULT, (u32) stats, 0);
+
+  heap[BENCH_FAULT_PAGES * PAGE_SIZE] = 1;
+
+  while(1)
+  {
+    sys_sleep(0xffffffff);
+  }
+}
+
+// forks of a parent with 1 MiB of touched heap, copy on write against copying every page,
+// then the first store to each page, which copies it out of the frame shared with the children
+#define BENCH_FORK_PAGES  256
+#define BENCH_FORK_ROUNDS 8
+
+USER void bench_fork_main()
+{
+  struct CycleStats stats[3];
+  u8 volatile* heap = sys_sbrk(BENCH_FORK_PAGES * PAGE_SIZE);
+
+  for(u32 i = 0; i < BENCH_FORK_PAGES; ++i)
+  {
+    heap[i * PAGE_SIZE] = 1;
+  }
+
+  for(u32 cow = 0; cow < 2; ++cow)
+  {
+    stats_reset(&stats[cow]);
+
+    for(u32 i = 0; i < BENCH_FORK_ROUNDS; ++i)
+    {
+      u64 t0 = rdtsc();
+      u32 id = syscall(SYS_FORK, !cow, 0, 0);
+      u64 t1 = rdtsc();
+
+      if(id == 0)
+      {
+        while(1)
+        {
+          sys_sleep(0xffffffff);
+        }
+      }
+
+      if(id != (u32) -1)
+      {
+        stats_add(&stats[cow], (u32) (t1 - t0));
+      }
+    }
+  }
+
+  stats_reset(&stats[2]);
+
+  for(u32 i = 0; i < BENCH_FORK_PAGES; ++i)
+  {
+    u64 t0 = rdtsc();
+    heap[i * PAGE_SIZE] = 2;
+    u64 t1 = rdtsc();
+
+    stats_add(&stats[2], (u32) (t1 - t0));
+  }
+
+  syscall(SYS_BENCH, BENCH_REPORT_FORK, (u32) stats, 0);
+
+  while(1)
+  {
+    sys_sleep(0xffffffff);
+  }
+}
+
+// tasks that exit right away, the spawn system call and the time until the task ran and exited
+#define BENCH_SPAWN_ROUNDS 200
+
+u32 volatile bench_spawn_exits USER_DATA;
+
+USER void bench_spawn_child()
+{
+  __sync_fetch_and_add(&bench_spawn_exits, 1);
+  sys_exit();
+}
+
+USER void bench_spawn_main()
+{
+  struct CycleStats stats[2];
+  stats_reset(&stats[0]);
+  stats_reset(&stats[1]);
+
+  for(u32 i = 0; i < BENCH_SPAWN_ROUNDS; ++i)
+  {
+    u32 exits = bench_spawn_exits;
+
+    u64 t0 = rdtsc();
+    u32 id = sys_spawn(bench_spawn_child, PRIORITY_DEFAULT, 0);
+    u64 t1 = rdtsc();
+
+    if(id == (u32) -1)
+    {
+      break;
+    }
+
+    while(bench_spawn_exits == exits)
+    {
+      sys_sleep(0);
+    }
+
+    u64 t2 = rdtsc();
+
+    stats_add(&stats[0], (u32) (t1 - t0));
+    stats_add(&stats[1], (u32) (t2 - t0));
+  }
+
+  syscall(SYS_BENCH, BENCH_REPORT_SPAWN, (u32) stats, 0);
+
+  while(1)
+  {
+    sys_sleep(0xffffffff);
+  }
+}
+
+// a spawned peer answers ping pong messages over two channels, then takes 1 MiB as copied messages
+// and as moved pages, the sender waits for its answer after each transfer
+#define BENCH_IPC_ROUNDS 1000
+#define BENCH_IPC_PAGES  256
+#define BENCH_IPC_COPIES (BENCH_IPC_PAGES * PAGE_SIZE / MESSAGE_SIZE)
+
+struct BenchIpcResult
+{
+  struct CycleStats round_trip;
+  u64 copy_cycles;
+  u64 page_cycles;
+  u32 errors; // moved pages that arrived with other contents
+};
+
+USER void bench_ipc_peer_run(u32 channels)
+{
+  u32 ping = channels & 0xffff;
+  u32 pong = channels >> 16;
+  u8 message[MESSAGE_SIZE];
+
+  for(u32 i = 0; i < BENCH_IPC_ROUNDS; ++i)
+  {
+    sys_recv(ping, message, 0);
+    sys_send(pong, message, sizeof(u32));
+  }
+
+  for(u32 i = 0; i < BENCH_IPC_COPIES; ++i)
+  {
+    sys_recv(ping, message, 0);
+  }
+
+  sys_send(pong, message, 0);
+
+  u8* heap = sys_sbrk(BENCH_IPC_PAGES * PAGE_SIZE);
+  u32 errors = 0;
+
+  for(u32 i = 0; i < BENCH_IPC_PAGES; ++i)
+  {
+    u32* page = (u32*) (heap + i * PAGE_SIZE);
+
+    if(sys_recv(ping, message, page) != PAGE_SIZE || *page != i)
+    {
+      ++errors;
+    }
+  }
+
+  sys_send(pong, &errors, sizeof(errors));
+  sys_exit();
+}
+
+USER __attribute__((naked)) void bench_ipc_peer()
+{
+  asm volatile("push %eax"); // the channels
+  asm volatile("call bench_ipc_peer_run");
+}
+
+USER void bench_ipc_main()
+{
+  struct BenchIpcResult result;
+  u8 message[MESSAGE_SIZE];
+  u32 ping = sys_channel();
+  u32 pong = sys_channel();
+
+  stats_reset(&result.round_trip);
+  result.errors = BENCH_IPC_PAGES;
+
+  if(ping == (u32) -1 || pong == (u32) -1 || sys_spawn(bench_ipc_peer, PRIORITY_DEFAULT, ping | pong << 16) == (u32) -1)
+  {
+    syscall(SYS_BENCH, BENCH_REPORT_IPC, (u32) &result, 0);
+    sys_exit();
+  }
+
+  for(u32 i = 0; i < BENCH_IPC_ROUNDS; ++i)
+  {
+    u64 t0 = rdtsc();
+    sys_send(ping, &i, sizeof(i));
+    sys_recv(pong, message, 0);
+    u64 t1 = rdtsc();
+
+    stats_add(&result.round_trip, (u32) (t1 - t0));
+  }
+
+  u64 t0 = rdtsc();
+
+  for(u32 i = 0; i < BENCH_IPC_COPIES; ++i)
+  {
+    sys_send(ping, message, MESSAGE_SIZE);
+  }
+
+  sys_recv(pong, message, 0);
+  u64 t1 = rdtsc();
+
+  result.copy_cycles = t1 - t0;
+
+  // the pages are mapped before, so only moving them is measured
+  u8* heap = sys_sbrk(BENCH_IPC_PAGES * PAGE_SIZE);
+
+  for(u32 i = 0; i < BENCH_IPC_PAGES; ++i)
+  {
+    *(u32 volatile*) (heap + i * PAGE_SIZE) = i;
+  }
+
+  t0 = rdtsc();
+
+  for(u32 i = 0; i < BENCH_IPC_PAGES; ++i)
+  {
+    sys_send_page(ping, heap + i * PAGE_SIZE);
+  }
+
+  sys_recv(pong, &result.errors, 0);
+  t1 = rdtsc();
+
+  result.page_cycles = t1 - t0;
+
+  syscall(SYS_BENCH, BENCH_REPORT_IPC, (u32) &result, 0);
+  sys_exit();
+}
+
+void print_ipc_throughput(char const* name, u64 cycles)
+{
+  u32 kcycles = div_u64(cycles, 1000);
+
+  print("bench ");
+  print(name);
+  print(" kcycles:");
+  put_u32(kcycles);
+  print(" bytes/kcycle:");
+  put_u32(BENCH_IPC_PAGES * PAGE_SIZE / (kcycles ? kcycles : 1));
+  print("\n");
+}
+
+void print_cpu_stats(char const* name, struct CycleStats* per_cpu)
+{
+  struct CycleStats s;
+  stats_reset(&s);
+
+  for(u32 i = 0; i < num_cpus; ++i)
+  {
+    stats_merge(&s, &per_cpu[i]);
+  }
+
+  print_stats(name, &s);
+}
+
+// the last user benchmark to report ends the run
+void bench_task_done()
+{
+  if(__sync_sub_and_fetch(&bench_tasks_running, 1) == 0)
+  {
+    print_cpu_stats("timer interrupt latency", timer_latency_stats);
+    print_cpu_stats("timer interrupt handler", timer_handler_stats);
+    print_interrupt_stats();
+    print("benchmarks done\n");
+
+    debug_exit(0);
+  }
+}
+
+u32 syscall_bench(u32 bench, u32 arg, u32 a2)
+{
+  if(bench == BENCH_REPORT_SLEEP)
+  {
+    print_cpu_stats("sleep wakeup jitter", wakeup_stats);
+    print_cpu_stats("task switch", switch_stats);
+    bench_task_done();
+  }
+  else if(bench == BENCH_REPORT_FPU)
+  {
+    __sync_fetch_and_add(&bench_fpu_errors, arg);
+
+    if(__sync_add_and_fetch(&bench_fpu_done, 1) == BENCH_FPU_TASKS)
+    {
+      print_result("fpu state", "errors", bench_fpu_errors);
+
+      print_cpu_stats("fpu lazy restore", fpu_trap_stats);
+    }
+
+    bench_task_done();
+  }
+  else if(bench == BENCH_REPORT_SYSCALL)
+  {
+    struct CycleStats* stats = (struct CycleStats*) arg;
+
+    if(!user_accessible(arg, 2 * sizeof(struct CycleStats)))
+    {
+      bench_task_done();
+      return -1;
+    }
+
+    print_stats("null syscall int 0x80", &stats[0]);
+
+    if(stats[1].count)
+    {
+      print_stats("null syscall sysenter", &stats[1]);
+    }
+    else
+    {
+      print("sysenter not supported\n");
+    }
+
+    bench_task_done();
+  }
+  else if(bench == BENCH_REPORT_FAULT)
+  {
+    struct CycleStats* stats = (struct CycleStats*) arg;
+
+    if(user_accessible(arg, 2 * sizeof(struct CycleStats)))
+    {
+      print_stats("demand page fault", &stats[0]);
+      print_stats("store to mapped page", &stats[1]);
+      print_result("demand paging user", "pages", cpu_current()->task->user_pages);
+    }
+
+    bench_task_done();
+  }
+  else if(bench == BENCH_REPORT_FORK)
+  {
+    struct CycleStats* stats = (struct CycleStats*) arg;
+
+    if(user_accessible(arg, 3 * sizeof(struct CycleStats)))
+    {
+      print_stats("fork eager copy", &stats[0]);
+      print_stats("fork copy on write", &stats[1]);
+      print_stats("copy on write fault", &stats[2]);
+    }
+
+    bench_task_done();
+  }
+  else if(bench == BENCH_REPORT_SPAWN)
+  {
+    struct CycleStats* stats = (struct CycleStats*) arg;
+
+    if(user_accessible(arg, 2 * sizeof(struct CycleStats)))
+    {
+      print_stats("spawn", &stats[0]);
+      print_stats("spawn to exit", &stats[1]);
+    }
+
+    bench_task_done();
+  }
+  else if(bench == BENCH_REPORT_IPC)
+  {
+    struct BenchIpcResult* result = (struct BenchIpcResult*) arg;
+
+    if(user_accessible(arg, sizeof(struct BenchIpcResult)))
+    {
+      print_stats("ipc ping pong", &result->round_trip);
+      print_ipc_throughput("ipc bulk copy", result->copy_cycles);
+      print_ipc_throughput("ipc bulk page move", result->page_cycles);
+      print_result("ipc page move", "errors", result->errors);
+    }
+
+    bench_task_done();
+  }
+
+  return 0;
+}
+
+void bench_user()
+{
+  bench_start_task(0, (u32) bench_sleep_main);
+
+  if(fpu_supported)
+  {
+    for(u32 i = 0; i < BENCH_FPU_TASKS; ++i)
+    {
+      bench_start_task(PRIORITY_DEFAULT, (u32) bench_fpu_main);
+    }
+  }
+  else
+  {
+    print("fxsave not supported\n");
+  }
+
+  bench_start_task(PRIORITY_DEFAULT, (u32) bench_syscall_main);
+  bench_start_task(PRIORITY_DEFAULT, (u32) bench_fault_main);
+  bench_start_task(PRIORITY_DEFAULT, (u32) bench_fork_main);
+  bench_start_task(PRIORITY_DEFAULT, (u32) bench_spawn_main);
+  bench_start_task(PRIORITY_DEFAULT, (u32) bench_ipc_main);
+}
+
+void run_benchmarks()
+{
+  bench_frames();
+  bench_slab();
+  bench_large_pages();
+  bench_page_walks();
+  bench_exception();
+  bench_address_space_switch("switch with cr3 reload", 1);
+  bench_address_space_switch("switch without cr3 reload", 0);
+  bench_frame_copy();
+  bench_run_queue("run queue pick 1 waiting", 1);
+  bench_run_queue("run queue pick 64 waiting", 64);
+  bench_smp();
+  bench_console();
+  bench_trace();
+  bench_user();
+}
 
+#endif
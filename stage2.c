@@ -0,0 +1,99 @@
+// stage 2 of a compressed boot, the bootloader loads this stub with the lz4 compressed kernel behind it,
+// the stub decompresses the kernel to its load address and calls start
+
+typedef unsigned int u32;
+typedef unsigned short int u16;
+typedef unsigned char u8;
+
+typedef unsigned long long u64;
+
+void stage2_start(); // entry point, the bootloader finds it in the image header
+
+// written by tools/lz4.py behind the stub, the compressed kernel image follows
+struct Payload
+{
+  u32 compressed_size;
+  u32 load;  // load address of the kernel image
+  u32 entry; // start
+};
+
+// tsc around decompressing, the kernel prints them with the disk reads of the bootloader
+#define BOOT_INFO_DECOMPRESS 0x918
+
+extern u8 _stage2_end[];
+
+u64 rdtsc();
+void lz4_decompress(u8 const* src, u32 size, u8* dst);
+
+void stage2_start()
+{
+  struct Payload* payload = (struct Payload*) _stage2_end;
+  u64* times = (u64*) BOOT_INFO_DECOMPRESS;
+
+  times[0] = rdtsc();
+  lz4_decompress((u8 const*) (payload + 1), payload->compressed_size, (u8*) payload->load);
+  times[1] = rdtsc();
+
+  ((void (*)()) payload->entry)();
+}
+
+u64 rdtsc()
+{
+  u32 lo = 0;
+  u32 hi = 0;
+  asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((u64) hi << 32) | lo;
+}
+
+// a sequence is a token, literals and a match, the high nibble of the token is the number of literals,
+// the low nibble the match length minus 4, 15 in a nibble continues the length in the following bytes.
+// the match copies from offset bytes back in the output, the last sequence has no match
+u32 lz4_length(u8 const** src, u32 length)
+{
+  if(length == 15)
+  {
+    u8 b = 0;
+
+    do
+    {
+      b = *(*src)++;
+      length += b;
+    }
+    while(b == 255);
+  }
+
+  return length;
+}
+
+void lz4_decompress(u8 const* src, u32 size, u8* dst)
+{
+  u8 const* end = src + size;
+
+  while(src < end)
+  {
+    u8 token = *src++;
+    u32 literals = lz4_length(&src, token >> 4);
+
+    while(literals--)
+    {
+      *dst++ = *src++;
+    }
+
+    if(src >= end)
+    {
+      break;
+    }
+
+    u32 offset = src[0] | (src[1] << 8);
+    src += 2;
+
+    u32 length = lz4_length(&src, token & 0xf) + 4;
+    u8 const* match = dst - offset;
+
+    // byte by byte, the match may overlap the output
+    while(length--)
+    {
+      *dst++ = *match++;
+    }
+  }
+}
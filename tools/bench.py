@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+# collects the results of a benchmark run from the serial log of the kernel
+#
+# result lines are "bench <name> key:value ...", for example
+#   bench task switch n:120 min:812 avg:1040 max:5210
+#   bench console line, shadow buffer chars/s:41230000
+#
+# python3 tools/bench.py bench.log [--json bench.json] [--baseline old.json] [--threshold 10]
+
+import argparse
+import json
+import re
+import sys
+
+FIELD = re.compile(r'^([^\s:]+):(\d+)$')
+
+# larger values of these keys are better, all other values are cycles
+HIGHER_IS_BETTER = {'chars/s', 'jobs/mcycle', 'bytes/kcycle'}
+
+# keys compared with the baseline, the first one a result has
+COMPARED = ['avg', 'chars/s', 'jobs/mcycle', 'bytes/kcycle', 'kcycles', 'errors']
+
+
+def parse(log):
+    results = {}
+
+    for line in log.splitlines():
+        line = line.strip()
+
+        if not line.startswith('bench '):
+            continue
+
+        words = line[len('bench '):].split(' ')
+        pairs = []
+
+        # key:value pairs follow the name, which may contain spaces
+        while words and FIELD.match(words[-1]):
+            key, value = FIELD.match(words.pop()).groups()
+            pairs.insert(0, (key, int(value)))
+
+        fields = dict(pairs)
+
+        if words and fields:
+            name = ' '.join(words)
+            results.setdefault(name, {}).update(fields)
+
+    return results
+
+
+def compare(results, baseline, threshold):
+    regressions = 0
+
+    for name, fields in sorted(results.items()):
+        old = baseline.get(name)
+
+        if old is None:
+            continue
+
+        key = next((k for k in COMPARED if k in fields and k in old), None)
+
+        if key is None or old[key] == 0:
+            continue
+
+        change = (fields[key] - old[key]) * 100.0 / old[key]
+        worse = -change if key in HIGHER_IS_BETTER else change
+
+        mark = ''
+        if worse > threshold:
+            mark = '  REGRESSION'
+            regressions += 1
+
+        print('%-40s %-12s %12d -> %12d %+7.1f%%%s' % (name, key, old[key], fields[key], change, mark))
+
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description='collects the results of a benchmark run')
+    parser.add_argument('log')
+    parser.add_argument('--json', help='writes the results to this file')
+    parser.add_argument('--baseline', help='results of an earlier run to compare with')
+    parser.add_argument('--threshold', type=float, default=10.0, help='percent a result may get worse')
+    args = parser.parse_args()
+
+    with open(args.log, errors='replace') as f:
+        results = parse(f.read())
+
+    if not results:
+        sys.exit('no benchmark results in ' + args.log)
+
+    for name, fields in sorted(results.items()):
+        print('%-40s %s' % (name, ' '.join('%s:%d' % item for item in fields.items())))
+
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+
+        print()
+        if compare(results, baseline, args.threshold):
+            sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
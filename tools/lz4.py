@@ -0,0 +1,141 @@
+#!/usr/bin/env python3
+# builds a compressed boot image: the stage 2 stub followed by the kernel image as an lz4 block
+#
+# python3 tools/lz4.py stage2.bin main.bin main.lz4.bin
+#
+# both images start with the header the bootloader reads: magic, load address, size and entry point.
+# the size in the header of the stub is set to cover the payload, which is the compressed size,
+# the load address and the entry point of the kernel, followed by the compressed kernel image
+
+import struct
+import sys
+
+KERNEL_MAGIC = 0x4c4e524b
+HEADER = struct.Struct('<4I')
+
+MIN_MATCH = 4
+LAST_LITERALS = 5   # the block ends with at least this many literals
+MATCH_LIMIT = 12    # no match starts this close to the end
+MAX_OFFSET = 65535
+HASH_BITS = 16
+
+
+def put_length(out, length):
+    while length >= 255:
+        out.append(255)
+        length -= 255
+    out.append(length)
+
+
+def put_sequence(out, literals, offset, match_length):
+    token_literals = min(len(literals), 15)
+    token_match = 0 if match_length is None else min(match_length - MIN_MATCH, 15)
+    out.append(token_literals << 4 | token_match)
+
+    if len(literals) >= 15:
+        put_length(out, len(literals) - 15)
+
+    out += literals
+
+    if match_length is not None:
+        out += struct.pack('<H', offset)
+
+        if match_length - MIN_MATCH >= 15:
+            put_length(out, match_length - MIN_MATCH - 15)
+
+
+def compress(data):
+    out = bytearray()
+    table = {}
+    anchor = 0
+    pos = 0
+    limit = len(data) - MATCH_LIMIT
+
+    while pos < limit:
+        key = data[pos:pos + MIN_MATCH]
+        candidate = table.get(key)
+        table[key] = pos
+
+        if candidate is None or pos - candidate > MAX_OFFSET:
+            pos += 1
+            continue
+
+        length = MIN_MATCH
+        while pos + length < len(data) - LAST_LITERALS and data[candidate + length] == data[pos + length]:
+            length += 1
+
+        put_sequence(out, data[anchor:pos], pos - candidate, length)
+
+        pos += length
+        anchor = pos
+
+    put_sequence(out, data[anchor:], 0, None)
+    return bytes(out)
+
+
+def decompress(block):
+    out = bytearray()
+    src = 0
+
+    def length(value):
+        nonlocal src
+        if value == 15:
+            while True:
+                b = block[src]
+                src += 1
+                value += b
+                if b != 255:
+                    break
+        return value
+
+    while src < len(block):
+        token = block[src]
+        src += 1
+        literals = length(token >> 4)
+        out += block[src:src + literals]
+        src += literals
+
+        if src >= len(block):
+            break
+
+        offset = block[src] | block[src + 1] << 8
+        src += 2
+        match = length(token & 15) + MIN_MATCH
+
+        for _ in range(match):
+            out.append(out[-offset])
+
+    return bytes(out)
+
+
+def main():
+    if len(sys.argv) != 4:
+        sys.exit('usage: lz4.py stage2.bin kernel.bin output.bin')
+
+    stub = bytearray(open(sys.argv[1], 'rb').read())
+    kernel = open(sys.argv[2], 'rb').read()
+
+    magic, load, size, entry = HEADER.unpack_from(kernel, 0)
+    if magic != KERNEL_MAGIC:
+        sys.exit(sys.argv[2] + ' has no image header')
+
+    block = compress(kernel)
+    if decompress(block) != kernel:
+        sys.exit('lz4 round trip failed')
+
+    payload = struct.pack('<3I', len(block), load, entry) + block
+
+    stub_magic, stub_load, stub_size, stub_entry = HEADER.unpack_from(stub, 0)
+    if stub_magic != KERNEL_MAGIC or stub_size != len(stub):
+        sys.exit(sys.argv[1] + ' has no image header')
+
+    HEADER.pack_into(stub, 0, stub_magic, stub_load, len(stub) + len(payload), stub_entry)
+
+    with open(sys.argv[3], 'wb') as f:
+        f.write(stub + payload)
+
+    print('%s: %d -> %d bytes' % (sys.argv[3], len(kernel), len(stub) + len(payload)))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+# turns a dump of the sampling profiler into a flat profile of kernel and user functions
+#
+# in the qemu monitor: pmemsave 0x500000 0x81000 profile.bin
+# then: python3 tools/profile.py profile.bin main.sym [--top N]
+
+import argparse
+import bisect
+import struct
+import sys
+
+PROFILE_MAGIC = 0x464f5250
+HEADER_SIZE = 64
+PROFILE_TASKS = 64
+
+
+def read_symbols(path):
+    addrs = []
+    names = []
+    user = (0, 0)
+
+    with open(path) as f:
+        for line in f:
+            parts = line.split()
+
+            if len(parts) != 3:
+                continue
+
+            addr, kind, name = int(parts[0], 16), parts[1], parts[2]
+
+            if name == '_user_start':
+                user = (addr, user[1])
+            elif name == '_user_end':
+                user = (user[0], addr)
+            elif kind in 'Tt':
+                addrs.append(addr)
+                names.append(name)
+
+    return addrs, names, user
+
+
+def main():
+    parser = argparse.ArgumentParser(description='flat profile from a profiler dump')
+    parser.add_argument('dump')
+    parser.add_argument('symbols', help='main.sym or bench.sym of the same build')
+    parser.add_argument('--top', type=int, default=30)
+    args = parser.parse_args()
+
+    with open(args.dump, 'rb') as f:
+        dump = f.read()
+
+    magic, image_start, shift, num_buckets, samples, outside = struct.unpack_from('<6I', dump, 0)
+
+    if magic != PROFILE_MAGIC:
+        sys.exit('no profile in the dump, wrong address?')
+
+    tasks = struct.unpack_from('<%dI' % PROFILE_TASKS, dump, HEADER_SIZE)
+    buckets = struct.unpack_from('<%dI' % num_buckets, dump, HEADER_SIZE + PROFILE_TASKS * 4)
+
+    addrs, names, user = read_symbols(args.symbols)
+    functions = {}
+
+    for i, count in enumerate(buckets):
+        if count == 0:
+            continue
+
+        addr = image_start + (i << shift)
+        index = bisect.bisect_right(addrs, addr) - 1
+        name = names[index] if index >= 0 else '?'
+        functions[name] = functions.get(name, 0) + count
+
+    total = samples or 1
+
+    print('%d samples, %d outside the image' % (samples, outside))
+    print()
+    print('%7s %8s  %-6s %s' % ('%', 'samples', 'mode', 'function'))
+
+    ranked = sorted(functions.items(), key=lambda item: -item[1])
+
+    for name, count in ranked[:args.top]:
+        index = names.index(name) if name in names else -1
+        mode = 'user' if index >= 0 and user[0] <= addrs[index] < user[1] else 'kernel'
+        print('%6.2f%% %8d  %-6s %s' % (count * 100.0 / total, count, mode, name))
+
+    print()
+    print('%7s %8s  %s' % ('%', 'samples', 'task'))
+
+    for task, count in enumerate(tasks):
+        if count:
+            print('%6.2f%% %8d  %s' % (count * 100.0 / total, count, 'idle' if task == 0 else task))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+# turns a dump of the kernel trace buffer into a timeline
+#
+# in the qemu monitor: pmemsave 0x400000 0x81000 trace.bin
+# then: python3 tools/trace.py trace.bin [--cpu N]
+
+import argparse
+import struct
+import sys
+
+TRACE_MAGIC = 0x45435254
+HEADER_SIZE = 64
+RING_HEADER_SIZE = 64
+RECORD = struct.Struct('<QHHI')
+
+EVENTS = {
+    1: 'timer',
+    2: 'timer end',
+    3: 'switch',
+    4: 'syscall',
+    5: 'syscall end',
+    6: 'wake',
+    7: 'fpu trap',
+    8: 'fault',
+    9: 'irq',
+    10: 'halt',
+    11: 'page fault',
+}
+
+# end events and the event that opened them, their duration is printed
+PAIRS = {2: 1, 5: 4}
+
+
+def read_records(dump):
+    magic, num_cpus, records, tsc_per_tick, tick_hz = struct.unpack_from('<5I', dump, 0)
+
+    if magic != TRACE_MAGIC:
+        sys.exit('no trace buffer in the dump, wrong address?')
+
+    ring_size = RING_HEADER_SIZE + records * RECORD.size
+    events = []
+
+    for cpu in range(num_cpus):
+        ring = HEADER_SIZE + cpu * ring_size
+        head, = struct.unpack_from('<I', dump, ring)
+
+        # the ring holds the last records entries
+        for i in range(max(0, head - records), head):
+            offset = ring + RING_HEADER_SIZE + (i % records) * RECORD.size
+            tsc, event, task, arg = RECORD.unpack_from(dump, offset)
+            events.append((tsc, cpu, event, task, arg))
+
+    events.sort()
+    return events, tsc_per_tick * tick_hz
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('dump')
+    parser.add_argument('--cpu', type=int, help='only events of this cpu')
+    args = parser.parse_args()
+
+    with open(args.dump, 'rb') as f:
+        dump = f.read()
+
+    events, tsc_hz = read_records(dump)
+
+    if not events:
+        print('trace is empty')
+        return
+
+    start = events[0][0]
+    opened = {}
+
+    print('%12s %3s %5s %-12s %10s %10s' % ('time us', 'cpu', 'task', 'event', 'arg', 'cycles'))
+
+    for tsc, cpu, event, task, arg in events:
+        cycles = ''
+
+        if event in PAIRS.values():
+            opened[cpu, event] = tsc
+        elif event in PAIRS and (cpu, PAIRS[event]) in opened:
+            cycles = str(tsc - opened.pop((cpu, PAIRS[event])))
+
+        if args.cpu is not None and cpu != args.cpu:
+            continue
+
+        us = (tsc - start) * 1e6 / tsc_hz if tsc_hz else 0
+        name = EVENTS.get(event, 'event %d' % event)
+
+        print('%12.3f %3d %5d %-12s %10x %10s' % (us, cpu, task, name, arg, cycles))
+
+
+if __name__ == '__main__':
+    main()